@@ -0,0 +1,454 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <initializer_list>
+#include <limits>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+// 向量版本只为x86-64提供
+#if defined(__x86_64__) || defined(_M_X64)
+#define PATTERNS_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// MSVC不需要为某个函数单独打开指令集
+#if defined(__GNUC__) || defined(__clang__)
+#define PATTERNS_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PATTERNS_TARGET(isa)
+#endif
+
+namespace patterns::strategy {
+// 按能力从低到高排列
+enum class CpuLevel : std::uint8_t {
+    Scalar,
+    Sse42,
+    Avx2,
+    Avx512,
+};
+
+inline constexpr std::size_t kCpuLevelCount = 4;
+
+[[nodiscard]] constexpr std::string_view ToString(CpuLevel level) noexcept {
+    constexpr auto names = std::array<std::string_view, kCpuLevelCount>{
+        "scalar", "sse4.2", "avx2", "avx512"
+    };
+    return names[static_cast<std::size_t>(level)];
+}
+
+[[nodiscard]] constexpr std::optional<CpuLevel> ParseCpuLevel(std::string_view name) noexcept {
+    for (auto index = std::size_t{ 0 }; index < kCpuLevelCount; ++index) {
+        if (ToString(static_cast<CpuLevel>(index)) == name) {
+            return static_cast<CpuLevel>(index);
+        }
+    }
+    return std::nullopt;
+}
+
+namespace detail {
+#if PATTERNS_X86
+struct CpuidResult {
+    std::uint32_t eax, ebx, ecx, edx;
+};
+
+inline CpuidResult Cpuid(std::uint32_t leaf, std::uint32_t subleaf) noexcept {
+#if defined(_MSC_VER)
+    auto registers = std::array<int, 4>{};
+    __cpuidex(registers.data(), static_cast<int>(leaf), static_cast<int>(subleaf));
+    return { static_cast<std::uint32_t>(registers[0]), static_cast<std::uint32_t>(registers[1]),
+             static_cast<std::uint32_t>(registers[2]), static_cast<std::uint32_t>(registers[3]) };
+#else
+    auto result = CpuidResult{};
+    __cpuid_count(leaf, subleaf, result.eax, result.ebx, result.ecx, result.edx);
+    return result;
+#endif
+}
+
+// 操作系统在上下文切换时保存了哪些寄存器
+inline std::uint64_t Xgetbv() noexcept {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    auto eax = std::uint32_t{};
+    auto edx = std::uint32_t{};
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<std::uint64_t>(edx) << 32) | eax;
+#endif
+}
+#endif
+
+constexpr bool HasBit(std::uint32_t value, unsigned bit) noexcept {
+    return (value >> bit & 1U) != 0;
+}
+} // namespace detail
+
+/**
+ * @brief 用cpuid检测当前机器支持的最高级别.
+ *
+ * AVX及以上还要求操作系统通过XSAVE保存对应的寄存器；AVX-512级别要求同时支持F和BW.
+ */
+[[nodiscard]] inline CpuLevel DetectHardwareCpuLevel() noexcept {
+#if PATTERNS_X86
+    using detail::HasBit;
+
+    if (detail::Cpuid(0, 0).eax < 7) {
+        return HasBit(detail::Cpuid(1, 0).ecx, 20) ? CpuLevel::Sse42 : CpuLevel::Scalar;
+    }
+
+    auto const basic    = detail::Cpuid(1, 0);
+    auto const extended = detail::Cpuid(7, 0);
+    if (!HasBit(basic.ecx, 20)) {
+        return CpuLevel::Scalar;
+    }
+    // OSXSAVE和AVX
+    if (!HasBit(basic.ecx, 27) || !HasBit(basic.ecx, 28)) {
+        return CpuLevel::Sse42;
+    }
+
+    auto const xcr0 = detail::Xgetbv();
+    // XMM和YMM
+    if ((xcr0 & 0x6U) != 0x6U || !HasBit(extended.ebx, 5)) {
+        return CpuLevel::Sse42;
+    }
+    // opmask、ZMM高256位和ZMM16-31，AVX512F和AVX512BW
+    if ((xcr0 & 0xE0U) != 0xE0U || !HasBit(extended.ebx, 16) || !HasBit(extended.ebx, 30)) {
+        return CpuLevel::Avx2;
+    }
+    return CpuLevel::Avx512;
+#else
+    return CpuLevel::Scalar;
+#endif
+}
+
+// 把硬件级别限制在name指定的级别以内，name无效时忽略
+[[nodiscard]] constexpr CpuLevel LimitCpuLevel(CpuLevel hardware, std::string_view name) noexcept {
+    auto const requested = ParseCpuLevel(name);
+    return requested && *requested < hardware ? *requested : hardware;
+}
+
+/**
+ * @brief 本进程使用的级别，只检测一次.
+ *
+ * 测试时可以通过环境变量PATTERNS_CPU_LEVEL（scalar、sse4.2、avx2、avx512）降低级别，
+ * 但不会超过硬件支持的级别.
+ */
+[[nodiscard]] inline CpuLevel DetectCpuLevel() noexcept {
+    static auto const level = []() {
+        auto const hardware = DetectHardwareCpuLevel();
+        auto const* name    = std::getenv("PATTERNS_CPU_LEVEL");
+        return name != nullptr ? LimitCpuLevel(hardware, name) : hardware;
+    }();
+    return level;
+}
+
+template <typename Signature>
+class CpuDispatch;
+
+/**
+ * @brief 按CPU级别分派的策略.
+ *
+ * 每个级别注册一个实现，第一次调用时选出不超过DetectCpuLevel()的最高级别实现，
+ * 此后每次调用只是通过一个普通的函数指针，也可以用Get()取出来交给StrategyInvoker.
+ * 注册需要在第一次调用之前完成，Scalar级别的实现必须提供.
+ */
+template <typename Ret, typename... Args>
+class CpuDispatch<Ret(Args...)> {
+public:
+    using function_type = Ret (*)(Args...);
+    using self_type     = CpuDispatch;
+
+    CpuDispatch() = default;
+    CpuDispatch(std::initializer_list<std::pair<CpuLevel, function_type>> implementations) {
+        for (auto [level, function] : implementations) {
+            Register(level, function);
+        }
+    }
+
+    CpuDispatch(CpuDispatch const&)            = delete;
+    CpuDispatch& operator=(CpuDispatch const&) = delete;
+
+    void Register(CpuLevel level, function_type function) noexcept {
+        implementations_[static_cast<std::size_t>(level)] = function;
+        bound_.store(nullptr, std::memory_order_release);
+    }
+
+    // 第一次调用时绑定
+    [[nodiscard]] function_type Get() const {
+        if (auto function = bound_.load(std::memory_order_acquire)) [[likely]] {
+            return function;
+        }
+        auto const function = Get(DetectCpuLevel());
+        bound_.store(function, std::memory_order_release);
+        return function;
+    }
+
+    // 不超过level的最高级别实现
+    [[nodiscard]] function_type Get(CpuLevel level) const {
+        for (auto index = static_cast<std::size_t>(level) + 1; index-- > 0;) {
+            if (implementations_[index] != nullptr) {
+                return implementations_[index];
+            }
+        }
+        throw std::runtime_error("No implementation registered for this CPU");
+    }
+
+    Ret operator()(Args... args) const { return Get()(std::forward<Args>(args)...); }
+
+private:
+    std::array<function_type, kCpuLevelCount> implementations_{};
+    mutable std::atomic<function_type> bound_{ nullptr };
+};
+
+namespace kernels {
+namespace detail {
+inline std::int64_t SumScalar(std::span<std::int32_t const> values) noexcept {
+    auto total = std::int64_t{ 0 };
+    for (auto value : values) {
+        total += value;
+    }
+    return total;
+}
+
+inline std::ranges::min_max_result<std::int32_t>
+MinMaxScalar(std::span<std::int32_t const> values) noexcept {
+    auto result = std::ranges::min_max_result<std::int32_t>{
+        std::numeric_limits<std::int32_t>::max(), std::numeric_limits<std::int32_t>::min()
+    };
+    for (auto value : values) {
+        result.min = std::min(result.min, value);
+        result.max = std::max(result.max, value);
+    }
+    return result;
+}
+
+inline std::size_t FindScalar(std::span<std::uint8_t const> bytes, std::uint8_t value) noexcept {
+    for (auto index = std::size_t{ 0 }; index < bytes.size(); ++index) {
+        if (bytes[index] == value) {
+            return index;
+        }
+    }
+    return bytes.size();
+}
+
+#if PATTERNS_X86
+// 向量部分处理不了的尾部交给标量版本
+PATTERNS_TARGET("sse4.2")
+inline std::int64_t SumSse42(std::span<std::int32_t const> values) noexcept {
+    auto low   = _mm_setzero_si128();
+    auto high  = _mm_setzero_si128();
+    auto index = std::size_t{ 0 };
+    for (; index + 4 <= values.size(); index += 4) {
+        auto const block =
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(values.data() + index));
+        low  = _mm_add_epi64(low, _mm_cvtepi32_epi64(block));
+        high = _mm_add_epi64(high, _mm_cvtepi32_epi64(_mm_srli_si128(block, 8)));
+    }
+    auto const sum = _mm_add_epi64(low, high);
+    return _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1) +
+           SumScalar(values.subspan(index));
+}
+
+PATTERNS_TARGET("avx2")
+inline std::int64_t SumAvx2(std::span<std::int32_t const> values) noexcept {
+    auto low   = _mm256_setzero_si256();
+    auto high  = _mm256_setzero_si256();
+    auto index = std::size_t{ 0 };
+    for (; index + 8 <= values.size(); index += 8) {
+        auto const block =
+            _mm256_loadu_si256(reinterpret_cast<__m256i const*>(values.data() + index));
+        low  = _mm256_add_epi64(low, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(block)));
+        high = _mm256_add_epi64(high, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(block, 1)));
+    }
+    auto const wide = _mm256_add_epi64(low, high);
+    auto const sum =
+        _mm_add_epi64(_mm256_castsi256_si128(wide), _mm256_extracti128_si256(wide, 1));
+    return _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1) +
+           SumScalar(values.subspan(index));
+}
+
+PATTERNS_TARGET("avx512f")
+inline std::int64_t SumAvx512(std::span<std::int32_t const> values) noexcept {
+    auto low   = _mm512_setzero_si512();
+    auto high  = _mm512_setzero_si512();
+    auto index = std::size_t{ 0 };
+    // 这里和下面都避开了内部使用_mm512_undefined_*的指令，GCC 12会误报未初始化
+    for (; index + 16 <= values.size(); index += 16) {
+        auto const* data = reinterpret_cast<__m256i const*>(values.data() + index);
+        low  = _mm512_add_epi64(low, _mm512_maskz_cvtepi32_epi64(0xFF, _mm256_loadu_si256(data)));
+        high =
+            _mm512_add_epi64(high, _mm512_maskz_cvtepi32_epi64(0xFF, _mm256_loadu_si256(data + 1)));
+    }
+    alignas(64) auto lanes = std::array<std::int64_t, 8>{};
+    _mm512_store_si512(lanes.data(), _mm512_add_epi64(low, high));
+    auto total = SumScalar(values.subspan(index));
+    for (auto lane : lanes) {
+        total += lane;
+    }
+    return total;
+}
+
+PATTERNS_TARGET("sse4.2")
+inline std::ranges::min_max_result<std::int32_t>
+ReduceMinMax(__m128i min, __m128i max) noexcept {
+    min = _mm_min_epi32(min, _mm_shuffle_epi32(min, 0x4E));
+    min = _mm_min_epi32(min, _mm_shuffle_epi32(min, 0xB1));
+    max = _mm_max_epi32(max, _mm_shuffle_epi32(max, 0x4E));
+    max = _mm_max_epi32(max, _mm_shuffle_epi32(max, 0xB1));
+    return { _mm_cvtsi128_si32(min), _mm_cvtsi128_si32(max) };
+}
+
+inline std::ranges::min_max_result<std::int32_t> Merge(
+    std::ranges::min_max_result<std::int32_t> lhs,
+    std::ranges::min_max_result<std::int32_t> rhs
+) noexcept {
+    return { std::min(lhs.min, rhs.min), std::max(lhs.max, rhs.max) };
+}
+
+PATTERNS_TARGET("sse4.2")
+inline std::ranges::min_max_result<std::int32_t>
+MinMaxSse42(std::span<std::int32_t const> values) noexcept {
+    auto min   = _mm_set1_epi32(std::numeric_limits<std::int32_t>::max());
+    auto max   = _mm_set1_epi32(std::numeric_limits<std::int32_t>::min());
+    auto index = std::size_t{ 0 };
+    for (; index + 4 <= values.size(); index += 4) {
+        auto const block =
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(values.data() + index));
+        min = _mm_min_epi32(min, block);
+        max = _mm_max_epi32(max, block);
+    }
+    return Merge(ReduceMinMax(min, max), MinMaxScalar(values.subspan(index)));
+}
+
+PATTERNS_TARGET("avx2")
+inline std::ranges::min_max_result<std::int32_t>
+MinMaxAvx2(std::span<std::int32_t const> values) noexcept {
+    auto min   = _mm256_set1_epi32(std::numeric_limits<std::int32_t>::max());
+    auto max   = _mm256_set1_epi32(std::numeric_limits<std::int32_t>::min());
+    auto index = std::size_t{ 0 };
+    for (; index + 8 <= values.size(); index += 8) {
+        auto const block =
+            _mm256_loadu_si256(reinterpret_cast<__m256i const*>(values.data() + index));
+        min = _mm256_min_epi32(min, block);
+        max = _mm256_max_epi32(max, block);
+    }
+    auto const result = ReduceMinMax(
+        _mm_min_epi32(_mm256_castsi256_si128(min), _mm256_extracti128_si256(min, 1)),
+        _mm_max_epi32(_mm256_castsi256_si128(max), _mm256_extracti128_si256(max, 1))
+    );
+    return Merge(result, MinMaxScalar(values.subspan(index)));
+}
+
+PATTERNS_TARGET("avx512f")
+inline std::ranges::min_max_result<std::int32_t>
+MinMaxAvx512(std::span<std::int32_t const> values) noexcept {
+    auto min   = _mm512_set1_epi32(std::numeric_limits<std::int32_t>::max());
+    auto max   = _mm512_set1_epi32(std::numeric_limits<std::int32_t>::min());
+    auto index = std::size_t{ 0 };
+    for (; index + 16 <= values.size(); index += 16) {
+        auto const block = _mm512_loadu_si512(values.data() + index);
+        min              = _mm512_mask_min_epi32(min, 0xFFFF, min, block);
+        max              = _mm512_mask_max_epi32(max, 0xFFFF, max, block);
+    }
+    // 最后一次的归约不在热路径上，存出来再用标量版本
+    alignas(64) auto lanes = std::array<std::int32_t, 16>{};
+    _mm512_store_si512(lanes.data(), min);
+    auto const low = MinMaxScalar(lanes).min;
+    _mm512_store_si512(lanes.data(), max);
+    auto const high = MinMaxScalar(lanes).max;
+    return Merge({ low, high }, MinMaxScalar(values.subspan(index)));
+}
+
+PATTERNS_TARGET("sse4.2")
+inline std::size_t FindSse42(std::span<std::uint8_t const> bytes, std::uint8_t value) noexcept {
+    auto const needle = _mm_set1_epi8(static_cast<char>(value));
+    auto index        = std::size_t{ 0 };
+    for (; index + 16 <= bytes.size(); index += 16) {
+        auto const block =
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(bytes.data() + index));
+        auto const mask =
+            static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)));
+        if (mask != 0) {
+            return index + static_cast<std::size_t>(std::countr_zero(mask));
+        }
+    }
+    return index + FindScalar(bytes.subspan(index), value);
+}
+
+PATTERNS_TARGET("avx2")
+inline std::size_t FindAvx2(std::span<std::uint8_t const> bytes, std::uint8_t value) noexcept {
+    auto const needle = _mm256_set1_epi8(static_cast<char>(value));
+    auto index        = std::size_t{ 0 };
+    for (; index + 32 <= bytes.size(); index += 32) {
+        auto const block =
+            _mm256_loadu_si256(reinterpret_cast<__m256i const*>(bytes.data() + index));
+        auto const mask =
+            static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)));
+        if (mask != 0) {
+            return index + static_cast<std::size_t>(std::countr_zero(mask));
+        }
+    }
+    return index + FindScalar(bytes.subspan(index), value);
+}
+
+PATTERNS_TARGET("avx512f,avx512bw")
+inline std::size_t FindAvx512(std::span<std::uint8_t const> bytes, std::uint8_t value) noexcept {
+    auto const needle = _mm512_set1_epi8(static_cast<char>(value));
+    auto index        = std::size_t{ 0 };
+    for (; index + 64 <= bytes.size(); index += 64) {
+        auto const block = _mm512_loadu_si512(bytes.data() + index);
+        auto const mask  = static_cast<std::uint64_t>(_mm512_cmpeq_epi8_mask(block, needle));
+        if (mask != 0) {
+            return index + static_cast<std::size_t>(std::countr_zero(mask));
+        }
+    }
+    return index + FindScalar(bytes.subspan(index), value);
+}
+#endif
+} // namespace detail
+
+// 32位整数求和，结果是64位，不会溢出
+inline CpuDispatch<std::int64_t(std::span<std::int32_t const>)> const Sum{
+    { CpuLevel::Scalar, &detail::SumScalar },
+#if PATTERNS_X86
+    { CpuLevel::Sse42, &detail::SumSse42 },
+    { CpuLevel::Avx2, &detail::SumAvx2 },
+    { CpuLevel::Avx512, &detail::SumAvx512 },
+#endif
+};
+
+// 空区间返回{INT32_MAX, INT32_MIN}
+inline CpuDispatch<std::ranges::min_max_result<std::int32_t>(std::span<std::int32_t const>)> const
+    MinMax{
+        { CpuLevel::Scalar, &detail::MinMaxScalar },
+#if PATTERNS_X86
+        { CpuLevel::Sse42, &detail::MinMaxSse42 },
+        { CpuLevel::Avx2, &detail::MinMaxAvx2 },
+        { CpuLevel::Avx512, &detail::MinMaxAvx512 },
+#endif
+    };
+
+// 类似memchr，返回第一个等于value的下标，找不到时返回bytes.size()
+inline CpuDispatch<std::size_t(std::span<std::uint8_t const>, std::uint8_t)> const Find{
+    { CpuLevel::Scalar, &detail::FindScalar },
+#if PATTERNS_X86
+    { CpuLevel::Sse42, &detail::FindSse42 },
+    { CpuLevel::Avx2, &detail::FindAvx2 },
+    { CpuLevel::Avx512, &detail::FindAvx512 },
+#endif
+};
+} // namespace kernels
+} // namespace patterns::strategy
@@ -1,12 +1,48 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <compare>
+#include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <exception>
 #include <functional>
+#include <future>
+#include <istream>
+#include <iterator>
+#include <limits>
+#include <list>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <ostream>
+#include <random>
+#include <ranges>
+#include <span>
 #include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <variant>
 #include <vector>
 
+#include "thread_pool.hpp"
+
 namespace patterns {
 // 注释中涉及到的内容可能在之后多次涉及到，之后并不再提出
 // 通过将构造函数声明为protected，保证不直接使用这里提供的类（而是使用它的子类，并将子类的构造函数声明为public）
@@ -14,6 +50,113 @@ namespace patterns {
 // 迭代器模式的模板实现中也用到了门面（外观）模式，照着C++ Templates实现的，下面会提到
 // 只是设计模式学习的参照
 
+namespace meta {
+template <typename... Types>
+struct TypeList {};
+
+/**
+ * @brief 编译期得到的类型名，不同编译器给出的格式不同，不要拿来做持久化.
+ *
+ * @tparam T 类型
+ * @return constexpr std::string_view 类型名
+ */
+template <typename T>
+[[nodiscard]] constexpr std::string_view TypeName() noexcept {
+#if defined(_MSC_VER) && !defined(__clang__)
+    constexpr auto prefix = std::string_view{ "TypeName<" };
+    constexpr auto suffix = std::string_view{ ">(void)" };
+    auto name             = std::string_view{ __FUNCSIG__ };
+    name                  = name.substr(name.find(prefix) + prefix.size());
+    name                  = name.substr(0, name.rfind(suffix));
+    for (auto keyword : { std::string_view{ "class " }, std::string_view{ "struct " } }) {
+        if (name.starts_with(keyword)) {
+            name.remove_prefix(keyword.size());
+        }
+    }
+    return name;
+#else
+    constexpr auto prefix = std::string_view{ "T = " };
+    auto name             = std::string_view{ __PRETTY_FUNCTION__ };
+    auto const begin      = name.find(prefix) + prefix.size();
+    return name.substr(begin, name.find_first_of(";]", begin) - begin);
+#endif
+}
+
+// 类型参数中没有重复
+template <typename... Types>
+inline constexpr bool IsUnique = true;
+
+template <typename T, typename... Rest>
+inline constexpr bool IsUnique<T, Rest...> =
+    (!std::is_same_v<T, Rest> && ...) && IsUnique<Rest...>;
+
+// FNV-1a，编译期和运行期得到的结果相同
+[[nodiscard]] constexpr std::uint64_t Hash(std::string_view text) noexcept {
+    auto hash = std::uint64_t{ 14695981039346656037ULL };
+    for (auto character : text) {
+        hash ^= static_cast<std::uint8_t>(character);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+} // namespace meta
+
+namespace memory {
+// base-from-member：让内存资源先于使用它的基类构造、后于它析构
+template <typename Resource>
+class ResourceHolder {
+protected:
+    template <typename... Args>
+    explicit ResourceHolder(Args&&... args) : resource_(std::forward<Args>(args)...) {}
+
+    Resource resource_;
+};
+
+/**
+ * @brief 前N个元素存放在对象内部的栈，超出后才使用堆.
+ *
+ * 只支持在栈顶操作，元素需要可以默认构造和复制.
+ * @tparam T 元素类型
+ * @tparam N 内联容量
+ */
+template <typename T, std::size_t N>
+class SmallStack {
+public:
+    using value_type = T;
+    using self_type  = SmallStack;
+
+    [[nodiscard]] bool empty() const noexcept { return size_ == 0; }
+    [[nodiscard]] std::size_t size() const noexcept { return size_; }
+
+    void Push(T const& value) {
+        if (size_ < N) {
+            inline_[size_] = value;
+        }
+        else {
+            heap_.push_back(value);
+        }
+        ++size_;
+    }
+
+    void Pop() noexcept {
+        --size_;
+        if (size_ >= N) {
+            heap_.pop_back();
+        }
+    }
+
+    [[nodiscard]] T& Top() noexcept { return size_ <= N ? inline_[size_ - 1] : heap_.back(); }
+    [[nodiscard]] T const& Top() const noexcept {
+        return size_ <= N ? inline_[size_ - 1] : heap_.back();
+    }
+
+private:
+    std::array<T, N> inline_{};
+    std::vector<T> heap_;
+    std::size_t size_ = 0;
+};
+} // namespace memory
+
 namespace simplefactory {
 template <typename T>
 class Product {
@@ -27,23 +170,246 @@ protected:
     Product() = default;
 };
 
-template <typename ProductType>
+// 产品和控制块通过分配器一次分配，默认的std::allocator与std::make_shared等价
+template <typename ProductType, typename Allocator = std::allocator<ProductType>>
 requires std::is_base_of_v<Product<ProductType>, ProductType>
 class SimpleFactory {
 public:
-    using product_type = ProductType;
-    using self_type    = SimpleFactory;
+    using product_type   = ProductType;
+    using allocator_type = Allocator;
+    using self_type      = SimpleFactory;
 
     virtual ~SimpleFactory() = default;
 
     template <typename SpecificProductType, typename... Args>
     requires std::is_base_of_v<ProductType, SpecificProductType>
     [[nodiscard]] std::shared_ptr<SpecificProductType> Create(Args&&... args) {
-        return std::make_shared<SpecificProductType>(std::forward<Args>(args)...);
+        using rebind_type =
+            typename std::allocator_traits<Allocator>::template rebind_alloc<SpecificProductType>;
+        return std::allocate_shared<SpecificProductType>(
+            rebind_type(allocator_), std::forward<Args>(args)...
+        );
     }
 
+    [[nodiscard]] allocator_type GetAllocator() const noexcept { return allocator_; }
+
 protected:
     SimpleFactory() = default;
+    explicit SimpleFactory(allocator_type const& allocator) : allocator_(allocator) {}
+
+private:
+    [[no_unique_address]] allocator_type allocator_;
+};
+
+/**
+ * @brief 自带内存池的简单工厂.
+ *
+ * 产品与它的控制块都从工厂独占的PoolResource中分配，释放后回到池中复用。
+ * PoolResource可以是std::pmr::synchronized_pool_resource（默认，多线程共享一个工厂），
+ * std::pmr::unsynchronized_pool_resource（每个线程一个工厂）或std::pmr::monotonic_buffer_resource（只分配不回收）.
+ * 工厂析构时池一并释放，所以产品不能比工厂活得久.
+ * @tparam ProductType 抽象产品
+ * @tparam PoolResource 池的类型
+ */
+template <typename ProductType, typename PoolResource = std::pmr::synchronized_pool_resource>
+requires std::is_base_of_v<std::pmr::memory_resource, PoolResource>
+class PooledSimpleFactory
+    : private memory::ResourceHolder<PoolResource>,
+      public SimpleFactory<ProductType, std::pmr::polymorphic_allocator<ProductType>> {
+    using holder_type = memory::ResourceHolder<PoolResource>;
+    using base_type   = SimpleFactory<ProductType, std::pmr::polymorphic_allocator<ProductType>>;
+
+public:
+    using resource_type = PoolResource;
+    using self_type     = PooledSimpleFactory;
+
+    PooledSimpleFactory(PooledSimpleFactory const&)            = delete;
+    PooledSimpleFactory& operator=(PooledSimpleFactory const&) = delete;
+
+    [[nodiscard]] resource_type& GetResource() noexcept { return this->resource_; }
+
+protected:
+    template <typename... ResourceArgs>
+    requires std::is_constructible_v<PoolResource, ResourceArgs...>
+    explicit PooledSimpleFactory(ResourceArgs&&... resource_args)
+        : holder_type(std::forward<ResourceArgs>(resource_args)...), base_type(&this->resource_) {}
+};
+
+// 运行期选择产品时使用的键
+struct ProductId {
+    std::uint64_t value;
+
+    friend constexpr bool operator==(ProductId, ProductId) = default;
+};
+
+// 产品可以提供static constexpr std::string_view ProductName()作为注册名，否则使用类型名
+template <typename SpecificProductType>
+[[nodiscard]] constexpr std::string_view ProductName() noexcept {
+    if constexpr (requires {
+                      {
+                          SpecificProductType::ProductName()
+                      } -> std::convertible_to<std::string_view>;
+                  }) {
+        return SpecificProductType::ProductName();
+    }
+    else {
+        return meta::TypeName<SpecificProductType>();
+    }
+}
+
+template <typename ProductType, typename List, typename Allocator = std::allocator<ProductType>>
+class Registry;
+
+/**
+ * @brief 由类型列表生成的产品注册表，用运行期的键创建产品.
+ *
+ * 键是产品名的哈希，编译期为这些键找到一个完美哈希，
+ * 于是Create(id, args...)只需要一次取模和一次查表，然后通过函数指针调用对应的Create<SpecificProductType>.
+ * 未注册的键或者无法用args构造的产品返回nullptr.
+ * @tparam ProductType 抽象产品
+ * @tparam SpecificProductTypes 注册的具体产品
+ * @tparam Allocator 同SimpleFactory
+ */
+template <typename ProductType, typename... SpecificProductTypes, typename Allocator>
+requires(std::is_base_of_v<ProductType, SpecificProductTypes> && ...)
+class Registry<ProductType, meta::TypeList<SpecificProductTypes...>, Allocator>
+    : public SimpleFactory<ProductType, Allocator> {
+    using base_type = SimpleFactory<ProductType, Allocator>;
+
+    static constexpr auto keys_ =
+        std::array<std::uint64_t, sizeof...(SpecificProductTypes)>{ meta::Hash(
+            ProductName<SpecificProductTypes>()
+        )... };
+
+    struct PerfectHash {
+        std::uint64_t seed;
+        std::size_t size;
+
+        [[nodiscard]] constexpr std::size_t Slot(std::uint64_t key) const noexcept {
+            key ^= seed;
+            key ^= key >> 33;
+            key *= 0xff51afd7ed558ccdULL;
+            key ^= key >> 33;
+            return static_cast<std::size_t>(key % size);
+        }
+    };
+
+    // 重名的产品有相同的键，任何哈希都无法区分
+    static constexpr bool UniqueKeys() noexcept {
+        for (auto i = std::size_t{ 0 }; i < keys_.size(); ++i) {
+            for (auto j = i + 1; j < keys_.size(); ++j) {
+                if (keys_[i] == keys_[j]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // 表的大小从产品数开始尝试，最多到8倍，每个大小尝试256个种子
+    static constexpr PerfectHash FindPerfectHash() noexcept {
+        constexpr auto count = keys_.size();
+        if (!UniqueKeys()) {
+            // 已经由UniqueKeys报错，不再重复报找不到完美哈希
+            return PerfectHash{ 0, 1 };
+        }
+        for (auto size = std::size_t{ count == 0 ? 1 : count }; size <= count * 8 + 1; ++size) {
+            for (auto seed = std::uint64_t{ 0 }; seed < 256; ++seed) {
+                auto const hash = PerfectHash{ seed, size };
+                auto used       = std::array<bool, count * 8 + 1>{};
+                auto collided   = false;
+                for (auto key : keys_) {
+                    auto const slot = hash.Slot(key);
+                    collided        = collided || used[slot];
+                    used[slot]      = true;
+                }
+                if (!collided) {
+                    return hash;
+                }
+            }
+        }
+        return PerfectHash{ 0, 0 };
+    }
+
+    static_assert(UniqueKeys(), "product names registered in a Registry must be unique");
+
+    static constexpr auto hash_ = FindPerfectHash();
+    static_assert(
+        hash_.size != 0, "no perfect hash found for the product names within the search bound"
+    );
+
+    static constexpr auto slot_keys_ = []() {
+        auto slot_keys = std::array<std::uint64_t, hash_.size>{};
+        for (auto key : keys_) {
+            slot_keys[hash_.Slot(key)] = key;
+        }
+        return slot_keys;
+    }();
+
+    template <typename... Args>
+    using creator_type = std::shared_ptr<ProductType> (*)(Registry&, Args&&...);
+
+    template <typename SpecificProductType, typename... Args>
+    static std::shared_ptr<ProductType> CreateAs(Registry& self, Args&&... args) {
+        if constexpr (std::is_constructible_v<SpecificProductType, Args...>) {
+            return self.base_type::template Create<SpecificProductType>(
+                std::forward<Args>(args)...
+            );
+        }
+        else {
+            return nullptr;
+        }
+    }
+
+    // 跳转表，空槽位为nullptr
+    template <typename... Args>
+    static constexpr auto creators_ = []() {
+        auto creators = std::array<creator_type<Args...>, hash_.size>{};
+        ((creators[hash_.Slot(meta::Hash(ProductName<SpecificProductTypes>()))] =
+              &CreateAs<SpecificProductTypes, Args...>),
+         ...);
+        return creators;
+    }();
+
+public:
+    using product_type   = ProductType;
+    using allocator_type = Allocator;
+    using self_type      = Registry;
+
+    static constexpr std::size_t size = sizeof...(SpecificProductTypes);
+
+    template <typename SpecificProductType>
+    static constexpr ProductId id_of = ProductId{ meta::Hash(ProductName<SpecificProductType>()) };
+
+    [[nodiscard]] static constexpr ProductId Id(std::string_view name) noexcept {
+        return ProductId{ meta::Hash(name) };
+    }
+
+    [[nodiscard]] static constexpr bool Contains(ProductId id) noexcept {
+        auto const slot = hash_.Slot(id.value);
+        return slot_keys_[slot] == id.value;
+    }
+
+    using base_type::Create;
+
+    template <typename... Args>
+    [[nodiscard]] std::shared_ptr<ProductType> Create(ProductId id, Args&&... args) {
+        auto const slot    = hash_.Slot(id.value);
+        auto const creator = creators_<Args...>[slot];
+        if (slot_keys_[slot] != id.value || creator == nullptr) {
+            return nullptr;
+        }
+        return creator(*this, std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    [[nodiscard]] std::shared_ptr<ProductType> Create(std::string_view name, Args&&... args) {
+        return Create(Id(name), std::forward<Args>(args)...);
+    }
+
+protected:
+    Registry() = default;
+    using base_type::base_type;
 };
 } // namespace simplefactory
 
@@ -60,21 +426,265 @@ protected:
     Product() = default;
 };
 
-template <typename SpecificProductType>
+/**
+ * @brief 一块连续内存中的一批产品，拷贝共享同一块内存.
+ *
+ * @tparam T 产品
+ */
+template <typename T>
+class Batch {
+    template <typename, typename>
+    friend class Factory;
+
+public:
+    using value_type     = T;
+    using self_type      = Batch;
+    using size_type      = std::size_t;
+    using iterator       = T*;
+    using const_iterator = T const*;
+
+    Batch() = default;
+
+    [[nodiscard]] T* data() const noexcept { return storage_.get(); }
+    [[nodiscard]] size_type size() const noexcept { return size_; }
+    [[nodiscard]] bool empty() const noexcept { return size_ == 0; }
+    [[nodiscard]] iterator begin() const noexcept { return data(); }
+    [[nodiscard]] iterator end() const noexcept { return data() + size_; }
+    [[nodiscard]] T& operator[](size_type index) const noexcept { return data()[index]; }
+    [[nodiscard]] std::span<T> Span() const noexcept { return { data(), size_ }; }
+
+    // 单个产品的句柄，它会让整批产品一直存活
+    [[nodiscard]] std::shared_ptr<T> Share(size_type index) const noexcept {
+        return std::shared_ptr<T>(storage_, data() + index);
+    }
+
+private:
+    Batch(std::shared_ptr<T[]> storage, size_type size)
+        : storage_(std::move(storage)), size_(size) {}
+
+    std::shared_ptr<T[]> storage_;
+    size_type size_ = 0;
+};
+
+template <typename>
+struct MemberTraits;
+
+template <typename Class, typename Value>
+struct MemberTraits<Value Class::*> {
+    using class_type = Class;
+    using value_type = Value;
+};
+
+/**
+ * @brief 按成员拆开存储的一批产品（SoA），每个成员一列，列与列在同一块内存中.
+ *
+ * 只用于可平凡复制的产品，不在列中的成员取创建时的值.
+ * @tparam T 产品
+ * @tparam Members 作为列的成员指针
+ */
+template <typename T, auto... Members>
+requires std::is_trivially_copyable_v<T> &&
+         (std::is_base_of_v<typename MemberTraits<decltype(Members)>::class_type, T> && ...)
+class SoABatch {
+    template <typename, typename>
+    friend class Factory;
+
+    static constexpr auto members_ = std::make_tuple(Members...);
+
+public:
+    using value_type = T;
+    using self_type  = SoABatch;
+    using size_type  = std::size_t;
+
+    template <std::size_t Index>
+    using member_type = std::tuple_element_t<Index, std::tuple<decltype(Members)...>>;
+    template <std::size_t Index>
+    using column_type = typename MemberTraits<member_type<Index>>::value_type;
+
+    // 每一列都按缓存行对齐
+    static constexpr std::size_t alignment = 64;
+
+    SoABatch() = default;
+
+    [[nodiscard]] size_type size() const noexcept { return size_; }
+    [[nodiscard]] bool empty() const noexcept { return size_ == 0; }
+
+    template <std::size_t Index>
+    [[nodiscard]] std::span<column_type<Index>> Column() const noexcept {
+        return { reinterpret_cast<column_type<Index>*>(storage_.get() + offsets_[Index]), size_ };
+    }
+
+    [[nodiscard]] T Load(size_type index) const noexcept {
+        auto value = prototype_;
+        LoadColumns(value, index, std::index_sequence_for<decltype(Members)...>{});
+        return value;
+    }
+
+    void Store(size_type index, T const& value) const noexcept {
+        StoreColumns(value, index, std::index_sequence_for<decltype(Members)...>{});
+    }
+
+private:
+    struct alignas(alignment) Line {
+        std::byte bytes[alignment];
+    };
+
+    static constexpr std::size_t ColumnBytes(std::size_t size_of, size_type count) noexcept {
+        return (size_of * count + alignment - 1) / alignment * alignment;
+    }
+
+    template <std::size_t... Is>
+    void LoadColumns(T& value, size_type index, std::index_sequence<Is...>) const noexcept {
+        ((value.*std::get<Is>(members_) = Column<Is>()[index]), ...);
+    }
+
+    template <std::size_t... Is>
+    void StoreColumns(T const& value, size_type index, std::index_sequence<Is...>) const noexcept {
+        ((Column<Is>()[index] = value.*std::get<Is>(members_)), ...);
+    }
+
+    template <typename Allocator>
+    SoABatch(Allocator const& allocator, size_type size, T const& prototype)
+        : size_(size), prototype_(prototype) {
+        using rebind_type = typename std::allocator_traits<Allocator>::template rebind_alloc<Line>;
+        using traits      = std::allocator_traits<rebind_type>;
+
+        auto bytes = std::size_t{ 0 };
+        auto index = std::size_t{ 0 };
+        ((offsets_[index++] = bytes,
+          bytes += ColumnBytes(sizeof(typename MemberTraits<decltype(Members)>::value_type), size)),
+         ...);
+
+        auto line_allocator = rebind_type(allocator);
+        auto const lines    = bytes / alignment;
+        auto* data          = reinterpret_cast<std::byte*>(traits::allocate(line_allocator, lines));
+        storage_            = std::shared_ptr<std::byte[]>(
+            data,
+            [line_allocator, lines](std::byte* pointer) mutable {
+                traits::deallocate(line_allocator, reinterpret_cast<Line*>(pointer), lines);
+            },
+            line_allocator
+        );
+
+        for (auto i = size_type{ 0 }; i < size; ++i) {
+            Store(i, prototype);
+        }
+    }
+
+    std::shared_ptr<std::byte[]> storage_;
+    std::array<std::size_t, sizeof...(Members)> offsets_{};
+    size_type size_ = 0;
+    T prototype_{};
+};
+
+template <typename SpecificProductType, typename Allocator = std::allocator<SpecificProductType>>
 class Factory {
 public:
-    using product_type = SpecificProductType;
-    using type         = Factory;
+    using product_type   = SpecificProductType;
+    using allocator_type = Allocator;
+    using type           = Factory;
 
     virtual ~Factory() = default;
 
     template <typename... Args>
     [[nodiscard]] std::shared_ptr<SpecificProductType> Create(Args&&... args) {
-        return std::make_shared<SpecificProductType>(std::forward<Args>(args)...);
+        using rebind_type =
+            typename std::allocator_traits<Allocator>::template rebind_alloc<SpecificProductType>;
+        return std::allocate_shared<SpecificProductType>(
+            rebind_type(allocator_), std::forward<Args>(args)...
+        );
+    }
+
+    /**
+     * @brief 在一块连续内存中创建count个产品，每个产品都由args构造.
+     *
+     * @return Batch<SpecificProductType> 共享生命周期的产品序列
+     */
+    template <typename... Args>
+    [[nodiscard]] Batch<SpecificProductType> CreateN(std::size_t count, Args const&... args) {
+        using rebind_type =
+            typename std::allocator_traits<Allocator>::template rebind_alloc<SpecificProductType>;
+        using traits = std::allocator_traits<rebind_type>;
+
+        auto allocator   = rebind_type(allocator_);
+        auto* data       = traits::allocate(allocator, count);
+        auto constructed = std::size_t{ 0 };
+        try {
+            for (; constructed < count; ++constructed) {
+                traits::construct(allocator, data + constructed, args...);
+            }
+        }
+        catch (...) {
+            while (constructed != 0) {
+                traits::destroy(allocator, data + --constructed);
+            }
+            traits::deallocate(allocator, data, count);
+            throw;
+        }
+
+        auto storage = std::shared_ptr<SpecificProductType[]>(
+            data,
+            [allocator, count](SpecificProductType* pointer) mutable {
+                for (auto i = std::size_t{ 0 }; i < count; ++i) {
+                    traits::destroy(allocator, pointer + i);
+                }
+                traits::deallocate(allocator, pointer, count);
+            },
+            allocator
+        );
+        return Batch<SpecificProductType>(std::move(storage), count);
+    }
+
+    /**
+     * @brief 创建count个产品并按成员拆成列存储，产品必须可平凡复制.
+     *
+     * @tparam Members 作为列的成员指针
+     */
+    template <auto... Members, typename... Args>
+    requires std::is_trivially_copyable_v<SpecificProductType>
+    [[nodiscard]] SoABatch<SpecificProductType, Members...>
+    CreateSoA(std::size_t count, Args&&... args) {
+        return SoABatch<SpecificProductType, Members...>(
+            allocator_, count, SpecificProductType(std::forward<Args>(args)...)
+        );
     }
 
+    [[nodiscard]] allocator_type GetAllocator() const noexcept { return allocator_; }
+
 protected:
     Factory() = default;
+    explicit Factory(allocator_type const& allocator) : allocator_(allocator) {}
+
+private:
+    [[no_unique_address]] allocator_type allocator_;
+};
+
+// 与simplefactory::PooledSimpleFactory相同，产品不能比工厂活得久
+template <
+    typename SpecificProductType,
+    typename PoolResource = std::pmr::synchronized_pool_resource>
+requires std::is_base_of_v<std::pmr::memory_resource, PoolResource>
+class PooledFactory
+    : private memory::ResourceHolder<PoolResource>,
+      public Factory<SpecificProductType, std::pmr::polymorphic_allocator<SpecificProductType>> {
+    using holder_type = memory::ResourceHolder<PoolResource>;
+    using base_type =
+        Factory<SpecificProductType, std::pmr::polymorphic_allocator<SpecificProductType>>;
+
+public:
+    using resource_type = PoolResource;
+    using type          = PooledFactory;
+
+    PooledFactory(PooledFactory const&)            = delete;
+    PooledFactory& operator=(PooledFactory const&) = delete;
+
+    [[nodiscard]] resource_type& GetResource() noexcept { return this->resource_; }
+
+protected:
+    template <typename... ResourceArgs>
+    requires std::is_constructible_v<PoolResource, ResourceArgs...>
+    explicit PooledFactory(ResourceArgs&&... resource_args)
+        : holder_type(std::forward<ResourceArgs>(resource_args)...), base_type(&this->resource_) {}
 };
 } // namespace factory
 
@@ -107,6 +717,17 @@ protected:
     Builder() = default;
 };
 
+/**
+ * @brief 不经过虚函数、直接在产品上逐步构建的生成器.
+ *
+ * 只要求有product_type和非虚的Build(product_type&)，所有步骤都是constexpr时可以在编译期使用.
+ */
+template <typename B>
+concept InplaceBuilder = std::is_default_constructible_v<typename B::product_type> &&
+                         requires(B& builder, typename B::product_type& product) {
+                             builder.Build(product);
+                         };
+
 // Waiter
 class Director {
 public:
@@ -119,6 +740,30 @@ public:
         builder.Build(product);
         return product;
     }
+
+    // 按值返回产品，不分配内存，也没有引用计数和虚调用（依赖NRVO）
+    template <InplaceBuilder Builder>
+    [[nodiscard]] static constexpr auto Make(Builder& builder) -> typename Builder::product_type {
+        typename Builder::product_type product{};
+        builder.Build(product);
+        return product;
+    }
+
+    // 在调用者提供的未初始化存储上构建，适用于不可移动的产品或者对象池
+    // Build抛出异常时产品会被析构，storage恢复为未初始化
+    template <InplaceBuilder Builder>
+    static constexpr auto ConstructAt(Builder& builder, typename Builder::product_type* storage)
+        -> typename Builder::product_type* {
+        auto* product = std::construct_at(storage);
+        try {
+            builder.Build(*product);
+        }
+        catch (...) {
+            std::destroy_at(product);
+            throw;
+        }
+        return product;
+    }
 };
 } // namespace builder
 
@@ -126,8 +771,181 @@ class Prototype {
 public:
     virtual ~Prototype()                             = default;
     virtual std::shared_ptr<Prototype> Clone() const = 0;
+
+    // 在storage上原地克隆，storage至少要有CloneSize()字节并按CloneAlignment()对齐
+    virtual Prototype* CloneInto(void*) const {
+        throw std::runtime_error("CloneInto is not supported by this prototype");
+    }
+    [[nodiscard]] virtual std::size_t CloneSize() const noexcept { return 0; }
+    [[nodiscard]] virtual std::size_t CloneAlignment() const noexcept {
+        return alignof(std::max_align_t);
+    }
+};
+
+namespace prototype {
+// CRTP，用拷贝构造实现Prototype的全部克隆接口
+template <typename Derived, typename Base = Prototype>
+requires std::is_base_of_v<Prototype, Base>
+class Clonable : public Base {
+public:
+    virtual std::shared_ptr<Prototype> Clone() const override {
+        return std::make_shared<Derived>(static_cast<Derived const&>(*this));
+    }
+    virtual Prototype* CloneInto(void* storage) const override {
+        return ::new (storage) Derived(static_cast<Derived const&>(*this));
+    }
+    [[nodiscard]] virtual std::size_t CloneSize() const noexcept override {
+        return sizeof(Derived);
+    }
+    [[nodiscard]] virtual std::size_t CloneAlignment() const noexcept override {
+        return alignof(Derived);
+    }
+
+protected:
+    using Base::Base;
+    Clonable() = default;
 };
 
+/**
+ * @brief 写时复制的克隆，第一次写之前与原型共享同一个不可变对象.
+ *
+ * 借用的原型第一次写时总是复制；自己复制出来的对象由Cow之间的计数判断是否独占，
+ * 计数的减少是release、判断是acquire，所以其它线程上的Cow销毁之前的读取都发生在写之前.
+ * 一个Cow对象本身不能被多个线程同时使用，共享同一原型或者同一副本的不同Cow可以.
+ * @tparam T 被克隆的类型，派生自Prototype时用Clone()深拷贝，否则用拷贝构造
+ */
+template <typename T>
+class Cow {
+public:
+    using value_type = T;
+    using self_type  = Cow;
+
+    Cow() = default;
+    explicit Cow(std::shared_ptr<T> shared) : shared_(std::move(shared)) {}
+
+    Cow(Cow const& other) : shared_(other.shared_), owners_(other.owners_) {
+        if (owners_ != nullptr) {
+            owners_->fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    Cow(Cow&& other) noexcept
+        : shared_(std::move(other.shared_)), owners_(std::exchange(other.owners_, nullptr)) {}
+
+    Cow& operator=(Cow other) noexcept {
+        std::swap(shared_, other.shared_);
+        std::swap(owners_, other.owners_);
+        return *this;
+    }
+
+    ~Cow() { Release(); }
+
+    [[nodiscard]] T const& Read() const noexcept { return *shared_; }
+    [[nodiscard]] T const& operator*() const noexcept { return *shared_; }
+    [[nodiscard]] T const* operator->() const noexcept { return shared_.get(); }
+
+    [[nodiscard]] T& Write() {
+        if (Shared()) {
+            auto owners = std::make_unique<std::atomic<std::size_t>>(1);
+            auto copy   = std::shared_ptr<T>{};
+            if constexpr (std::is_base_of_v<Prototype, T>) {
+                copy = std::static_pointer_cast<T>(shared_->Clone());
+            }
+            else {
+                copy = std::make_shared<T>(*shared_);
+            }
+            Release();
+            shared_ = std::move(copy);
+            owners_ = owners.release();
+        }
+        return *shared_;
+    }
+
+    // 是否还在借用原型或者与其它Cow共享
+    [[nodiscard]] bool Shared() const noexcept {
+        return owners_ == nullptr || owners_->load(std::memory_order_acquire) != 1;
+    }
+
+private:
+    void Release() noexcept {
+        if (owners_ != nullptr && owners_->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete owners_;
+        }
+        owners_ = nullptr;
+    }
+
+    std::shared_ptr<T> shared_;
+    std::atomic<std::size_t>* owners_ = nullptr;
+};
+
+/**
+ * @brief 原型注册表.
+ *
+ * Clone得到写时复制的克隆，只增加一次引用计数；CloneInto在调用者提供的存储（比如对象池）上深拷贝.
+ * @tparam T 原型的类型
+ * @tparam Key 键
+ */
+template <typename T, typename Key = std::string>
+class Registry {
+public:
+    using value_type = T;
+    using key_type   = Key;
+    using self_type  = Registry;
+
+    virtual ~Registry() = default;
+
+    void Register(Key const& key, std::shared_ptr<T> prototype) {
+        prototypes_.insert_or_assign(key, std::move(prototype));
+    }
+
+    template <typename Specific>
+    requires std::is_base_of_v<T, std::decay_t<Specific>>
+    void Register(Key const& key, Specific&& prototype) {
+        Register(key, std::make_shared<std::decay_t<Specific>>(std::forward<Specific>(prototype)));
+    }
+
+    void Remove(Key const& key) { prototypes_.erase(key); }
+
+    [[nodiscard]] bool Contains(Key const& key) const { return prototypes_.contains(key); }
+
+    [[nodiscard]] Cow<T> Clone(Key const& key) const { return Cow<T>(prototypes_.at(key)); }
+
+    [[nodiscard]] std::size_t CloneSize(Key const& key) const {
+        if constexpr (std::is_base_of_v<Prototype, T>) {
+            return prototypes_.at(key)->CloneSize();
+        }
+        else {
+            return sizeof(T);
+        }
+    }
+
+    [[nodiscard]] std::size_t CloneAlignment(Key const& key) const {
+        if constexpr (std::is_base_of_v<Prototype, T>) {
+            return prototypes_.at(key)->CloneAlignment();
+        }
+        else {
+            return alignof(T);
+        }
+    }
+
+    // 调用者负责之后析构返回的对象
+    T* CloneInto(Key const& key, void* storage) const {
+        auto const& prototype = prototypes_.at(key);
+        if constexpr (std::is_base_of_v<Prototype, T>) {
+            return static_cast<T*>(prototype->CloneInto(storage));
+        }
+        else {
+            return ::new (storage) T(*prototype);
+        }
+    }
+
+protected:
+    Registry() = default;
+
+    std::unordered_map<Key, std::shared_ptr<T>> prototypes_;
+};
+} // namespace prototype
+
 template <typename Target, typename Adaptee>
 class Adapter : public Target {
 public:
@@ -145,214 +963,3627 @@ public:
     using value_type = T;
     using self_type  = Bridge;
 
-    virtual ~Bridge() = default;
-    [[nodiscard]] T& Get() { return object_; }
-    void Set(T object) { object_ = object; }
+    virtual ~Bridge() = default;
+    [[nodiscard]] T& Get() { return object_; }
+    void Set(T object) { object_ = object; }
+
+protected:
+    Bridge() = default;
+    T object_;
+};
+
+// 类型擦除
+template <typename T>
+class SpecificBridge : public Bridge<T> {
+public:
+    using value_type = T;
+    using self_type  = SpecificBridge<value_type>;
+};
+} // namespace bridge
+
+namespace composite {
+template <typename T>
+class Component {
+public:
+    using value_type = T;
+    using self_type  = Component;
+
+    virtual ~Component()                                      = default;
+    virtual void Add(std::shared_ptr<Component> component)    = 0;
+    virtual void Remove(std::shared_ptr<Component> component) = 0;
+
+    [[nodiscard]] virtual std::span<std::shared_ptr<Component> const> Children() const noexcept {
+        return {};
+    }
+};
+
+template <typename T>
+class Leaf : public Component<T> {
+public:
+    virtual void Add(std::shared_ptr<Component<T>> component) override {
+        throw std::runtime_error("Cannot add to a leaf");
+    }
+    virtual void Remove(std::shared_ptr<Component<T>> component) override {
+        throw std::runtime_error("Cannot add to a leaf");
+    };
+};
+
+template <typename T>
+class Composite : public Component<T> {
+public:
+    virtual void Add(std::shared_ptr<Component<T>> component) override {
+        children_.push_back(component);
+    }
+
+    virtual void Remove(std::shared_ptr<Component<T>> component) override {
+        if (auto it = std::find(children_.begin(), children_.end(), component);
+            it != children_.end()) {
+            children_.erase(it);
+        }
+    }
+
+    [[nodiscard]] virtual auto Children() const noexcept
+        -> std::span<std::shared_ptr<Component<T>> const> override {
+        return children_;
+    }
+
+private:
+    std::vector<std::shared_ptr<Component<T>>> children_;
+};
+
+namespace detail {
+template <typename T, typename Map, typename Combine>
+auto ReduceNode(ThreadPool& pool, Component<T>& node, Map& map, Combine& combine, std::size_t depth)
+    -> std::invoke_result_t<Map&, Component<T>&>;
+
+// 兄弟子树对半拆分，左半交给线程池，右半在当前线程上继续；超过max_depth之后顺序执行
+template <typename T, typename Map, typename Combine>
+auto ReduceChildren(
+    ThreadPool& pool,
+    std::span<std::shared_ptr<Component<T>> const> children,
+    Map& map,
+    Combine& combine,
+    std::size_t depth
+) -> std::invoke_result_t<Map&, Component<T>&> {
+    using result_type = std::invoke_result_t<Map&, Component<T>&>;
+
+    if (children.size() == 1) {
+        return ReduceNode(pool, *children.front(), map, combine, depth);
+    }
+
+    if (depth == 0) {
+        auto result = ReduceNode(pool, *children.front(), map, combine, depth);
+        for (auto const& child : children.subspan(1)) {
+            result = combine(std::move(result), ReduceNode(pool, *child, map, combine, depth));
+        }
+        return result;
+    }
+
+    auto const middle = children.size() / 2;
+    auto left         = std::optional<result_type>{};
+    auto group        = TaskGroup{ pool };
+    group.Run([&]() {
+        left.emplace(ReduceChildren(pool, children.first(middle), map, combine, depth - 1));
+    });
+    auto right = ReduceChildren(pool, children.subspan(middle), map, combine, depth - 1);
+    group.Wait();
+    return combine(std::move(*left), std::move(right));
+}
+
+template <typename T, typename Map, typename Combine>
+auto ReduceNode(ThreadPool& pool, Component<T>& node, Map& map, Combine& combine, std::size_t depth)
+    -> std::invoke_result_t<Map&, Component<T>&> {
+    auto result         = map(node);
+    auto const children = node.Children();
+    if (children.empty()) {
+        return result;
+    }
+    return combine(std::move(result), ReduceChildren(pool, children, map, combine, depth));
+}
+
+inline std::size_t SplitDepth(ThreadPool const& pool) noexcept {
+    // 大约拆成线程数的16倍个任务
+    auto depth = std::size_t{ 4 };
+    for (auto threads = pool.size(); threads > 1; threads >>= 1) {
+        ++depth;
+    }
+    return depth;
+}
+} // namespace detail
+
+/**
+ * @brief 在线程池上并行地归约一棵组合树.
+ *
+ * 结果等价于按先序遍历依次combine(map(node), ...)，所以combine只需要满足结合律.
+ * 并行只在子树边界上拆分.
+ * @param pool 线程池
+ * @param root 根节点
+ * @param map 节点 -> 结果
+ * @param combine (结果, 结果) -> 结果
+ */
+template <typename T, typename Map, typename Combine>
+auto Reduce(ThreadPool& pool, Component<T>& root, Map&& map, Combine&& combine)
+    -> std::invoke_result_t<Map&, Component<T>&> {
+    return detail::ReduceNode(pool, root, map, combine, detail::SplitDepth(pool));
+}
+
+// 在线程池上对每个节点调用function，不保证顺序
+template <typename T, typename Function>
+void ForEach(ThreadPool& pool, Component<T>& root, Function&& function) {
+    struct Unit {};
+    Reduce(
+        pool,
+        root,
+        [&function](Component<T>& node) {
+            function(node);
+            return Unit{};
+        },
+        [](Unit, Unit) { return Unit{}; }
+    );
+}
+
+/**
+ * @brief 扁平存储的组合树.
+ *
+ * 所有节点存放在几个稠密数组中：负载一列，父节点、首个/最后一个子节点、前后兄弟节点各一列，
+ * 这些链接保存的是槽位号，删除时把最后一个节点搬到空出的位置（swap-and-pop），句柄不会失效.
+ * 删除一个节点会连同它的子树一起删除，每个节点O(1)；不关心顺序的遍历直接线性扫描Payloads().
+ * @tparam T 节点负载
+ */
+template <typename T>
+class FlatComposite {
+public:
+    using value_type = T;
+    using self_type  = FlatComposite;
+    using size_type  = std::size_t;
+
+    struct Handle {
+        std::uint32_t index      = npos;
+        std::uint32_t generation = 0;
+
+        [[nodiscard]] explicit operator bool() const noexcept { return index != npos; }
+
+        friend constexpr bool operator==(Handle, Handle) = default;
+    };
+
+    static constexpr std::uint32_t npos = static_cast<std::uint32_t>(-1);
+
+    FlatComposite() = default;
+
+    void Reserve(size_type capacity) {
+        payloads_.reserve(capacity);
+        parents_.reserve(capacity);
+        first_children_.reserve(capacity);
+        last_children_.reserve(capacity);
+        prev_siblings_.reserve(capacity);
+        next_siblings_.reserve(capacity);
+        slots_of_.reserve(capacity);
+        slots_.reserve(capacity);
+    }
+
+    // parent为空句柄时添加一个根节点，新节点排在兄弟节点的最后
+    template <typename... Args>
+    Handle Add(Handle parent, Args&&... args) {
+        if (parent && !Contains(parent)) {
+            throw std::runtime_error("Cannot add to a removed node");
+        }
+
+        // 先为各列预留空间，构造负载之后的步骤都不会抛出异常，失败时各列保持一致
+        for (auto* column :
+             { &parents_, &first_children_, &last_children_, &prev_siblings_, &next_siblings_,
+               &slots_of_ }) {
+            GrowColumn(*column);
+        }
+        if (free_ == npos) {
+            GrowColumn(slots_);
+        }
+        payloads_.emplace_back(std::forward<Args>(args)...);
+        auto const slot = Allocate();
+
+        auto const parent_slot  = parent ? parent.index : npos;
+        auto const parent_dense = parent ? slots_[parent_slot].dense : npos;
+        auto const previous     = parent ? last_children_[parent_dense] : npos;
+        parents_.push_back(parent_slot);
+        first_children_.push_back(npos);
+        last_children_.push_back(npos);
+        prev_siblings_.push_back(previous);
+        next_siblings_.push_back(npos);
+
+        if (parent) {
+            if (previous == npos) {
+                first_children_[parent_dense] = slot;
+            }
+            else {
+                next_siblings_[slots_[previous].dense] = slot;
+            }
+            last_children_[parent_dense] = slot;
+        }
+        return Handle{ slot, slots_[slot].generation };
+    }
+
+    template <typename... Args>
+    Handle AddRoot(Args&&... args) {
+        return Add(Handle{}, std::forward<Args>(args)...);
+    }
+
+    void Remove(Handle handle) {
+        if (!Contains(handle)) {
+            return;
+        }
+
+        auto const slot  = handle.index;
+        auto const dense = slots_[slot].dense;
+        Unlink(dense);
+
+        // 借助父节点链接做不用栈的后序遍历，子节点总是先于父节点释放
+        auto current = Deepest(slot);
+        while (true) {
+            auto const current_dense = slots_[current].dense;
+            auto const next          = next_siblings_[current_dense];
+            auto const parent        = parents_[current_dense];
+            Free(current);
+            if (current == slot) {
+                break;
+            }
+            current = next != npos ? Deepest(next) : parent;
+        }
+    }
+
+    [[nodiscard]] bool Contains(Handle handle) const noexcept {
+        return handle.index < slots_.size() &&
+               slots_[handle.index].generation == handle.generation &&
+               (handle.generation & 1U) != 0;
+    }
+
+    [[nodiscard]] T& Get(Handle handle) noexcept { return payloads_[slots_[handle.index].dense]; }
+    [[nodiscard]] T const& Get(Handle handle) const noexcept {
+        return payloads_[slots_[handle.index].dense];
+    }
+
+    [[nodiscard]] Handle Parent(Handle handle) const noexcept {
+        return ToHandle(parents_[slots_[handle.index].dense]);
+    }
+    [[nodiscard]] Handle FirstChild(Handle handle) const noexcept {
+        return ToHandle(first_children_[slots_[handle.index].dense]);
+    }
+    [[nodiscard]] Handle NextSibling(Handle handle) const noexcept {
+        return ToHandle(next_siblings_[slots_[handle.index].dense]);
+    }
+
+    [[nodiscard]] size_type size() const noexcept { return payloads_.size(); }
+    [[nodiscard]] bool empty() const noexcept { return payloads_.empty(); }
+
+    // 稠密数组中第index个节点的句柄，与Payloads()[index]对应
+    [[nodiscard]] Handle HandleAt(size_type index) const noexcept {
+        return ToHandle(slots_of_[index]);
+    }
+
+    [[nodiscard]] std::span<T> Payloads() noexcept { return payloads_; }
+    [[nodiscard]] std::span<T const> Payloads() const noexcept { return payloads_; }
+
+    template <typename Function>
+    void ForEach(Function&& function) {
+        for (auto& payload : payloads_) {
+            function(payload);
+        }
+    }
+
+private:
+    // 存活的槽位代数为奇数，空闲槽位的dense是空闲链表的下一个槽位
+    struct Slot {
+        std::uint32_t dense;
+        std::uint32_t generation;
+    };
+
+    [[nodiscard]] Handle ToHandle(std::uint32_t slot) const noexcept {
+        return slot == npos ? Handle{} : Handle{ slot, slots_[slot].generation };
+    }
+
+    [[nodiscard]] std::uint32_t Deepest(std::uint32_t slot) const noexcept {
+        for (auto child = first_children_[slots_[slot].dense]; child != npos;
+             child      = first_children_[slots_[slot].dense]) {
+            slot = child;
+        }
+        return slot;
+    }
+
+    // 按倍数增长，之后的一次push_back不会重新分配
+    template <typename Column>
+    static void GrowColumn(Column& column) {
+        if (column.size() == column.capacity()) {
+            column.reserve(std::max<std::size_t>(column.size() * 2, 8));
+        }
+    }
+
+    std::uint32_t Allocate() {
+        auto const dense = static_cast<std::uint32_t>(payloads_.size() - 1);
+        auto slot        = free_;
+        if (slot == npos) {
+            slot = static_cast<std::uint32_t>(slots_.size());
+            slots_.push_back(Slot{ dense, 1 });
+        }
+        else {
+            free_ = slots_[slot].dense;
+            slots_[slot].dense = dense;
+            ++slots_[slot].generation;
+        }
+        slots_of_.push_back(slot);
+        return slot;
+    }
+
+    void Unlink(std::uint32_t dense) {
+        auto const parent   = parents_[dense];
+        auto const previous = prev_siblings_[dense];
+        auto const next     = next_siblings_[dense];
+        if (previous != npos) {
+            next_siblings_[slots_[previous].dense] = next;
+        }
+        else if (parent != npos) {
+            first_children_[slots_[parent].dense] = next;
+        }
+        if (next != npos) {
+            prev_siblings_[slots_[next].dense] = previous;
+        }
+        else if (parent != npos) {
+            last_children_[slots_[parent].dense] = previous;
+        }
+    }
+
+    void Free(std::uint32_t slot) {
+        auto const dense = slots_[slot].dense;
+        auto const last  = static_cast<std::uint32_t>(payloads_.size() - 1);
+        if (dense != last) {
+            payloads_[dense]       = std::move(payloads_[last]);
+            parents_[dense]        = parents_[last];
+            first_children_[dense] = first_children_[last];
+            last_children_[dense]  = last_children_[last];
+            prev_siblings_[dense]  = prev_siblings_[last];
+            next_siblings_[dense]  = next_siblings_[last];
+            slots_of_[dense]       = slots_of_[last];
+            slots_[slots_of_[dense]].dense = dense;
+        }
+
+        payloads_.pop_back();
+        parents_.pop_back();
+        first_children_.pop_back();
+        last_children_.pop_back();
+        prev_siblings_.pop_back();
+        next_siblings_.pop_back();
+        slots_of_.pop_back();
+
+        ++slots_[slot].generation;
+        slots_[slot].dense = free_;
+        free_              = slot;
+    }
+
+    std::vector<T> payloads_;
+    std::vector<std::uint32_t> parents_;
+    std::vector<std::uint32_t> first_children_;
+    std::vector<std::uint32_t> last_children_;
+    std::vector<std::uint32_t> prev_siblings_;
+    std::vector<std::uint32_t> next_siblings_;
+    std::vector<std::uint32_t> slots_of_;
+    std::vector<Slot> slots_;
+    std::uint32_t free_ = npos;
+};
+} // namespace composite
+
+namespace proxy {
+template <typename T>
+class Proxy : public T {
+public:
+    virtual ~Proxy() = default;
+
+    T* GetObject() {
+        if (!proxied_object_) {
+            proxied_object_ = object_create_method_();
+        }
+        return proxied_object_.get();
+    }
+    Proxy(std::function<std::unique_ptr<T>()> object_create_method)
+        : object_create_method_(object_create_method), proxied_object_(nullptr) {}
+
+private:
+    std::function<std::unique_ptr<T>()> object_create_method_;
+    mutable std::unique_ptr<T> proxied_object_;
+};
+
+/**
+ * @brief 线程安全的延迟初始化代理.
+ *
+ * 初始化之后GetObject只有一次acquire读；同时到来的首批调用者只有一个执行创建，其余的等待它完成.
+ * 创建抛出异常时状态复原，下一个调用者会重新尝试.
+ * 创建方法直接保存在代理中，不经过std::function.
+ * @tparam T 被代理的类型
+ * @tparam Creator 返回std::unique_ptr<T>的可调用对象
+ */
+template <typename T, typename Creator = std::unique_ptr<T> (*)()>
+requires std::is_convertible_v<std::invoke_result_t<Creator&>, std::unique_ptr<T>>
+class ConcurrentProxy {
+public:
+    using value_type = T;
+    using self_type  = ConcurrentProxy;
+
+    explicit ConcurrentProxy(Creator creator) : creator_(std::move(creator)) {}
+
+    ConcurrentProxy(ConcurrentProxy const&)            = delete;
+    ConcurrentProxy& operator=(ConcurrentProxy const&) = delete;
+
+    virtual ~ConcurrentProxy() = default;
+
+    [[nodiscard]] T* GetObject() {
+        if (auto* object = object_.load(std::memory_order_acquire)) {
+            return object;
+        }
+        return Initialize();
+    }
+
+    // 不触发创建，尚未创建时返回nullptr
+    [[nodiscard]] T* TryGet() const noexcept { return object_.load(std::memory_order_acquire); }
+
+private:
+    enum class State : unsigned char {
+        empty,
+        constructing,
+        ready
+    };
+
+    T* Initialize() {
+        auto expected = State::empty;
+        while (!state_.compare_exchange_strong(
+            expected, State::constructing, std::memory_order_acquire
+        )) {
+            if (expected == State::ready) {
+                return object_.load(std::memory_order_acquire);
+            }
+            state_.wait(State::constructing, std::memory_order_acquire);
+            expected = State::empty;
+        }
+
+        try {
+            owner_ = creator_();
+        }
+        catch (...) {
+            state_.store(State::empty, std::memory_order_release);
+            state_.notify_all();
+            throw;
+        }
+        object_.store(owner_.get(), std::memory_order_release);
+        state_.store(State::ready, std::memory_order_release);
+        state_.notify_all();
+        return owner_.get();
+    }
+
+    [[no_unique_address]] Creator creator_;
+    std::unique_ptr<T> owner_;
+    std::atomic<T*> object_{ nullptr };
+    std::atomic<State> state_{ State::empty };
+};
+
+template <typename Creator>
+ConcurrentProxy(Creator)
+    -> ConcurrentProxy<typename std::invoke_result_t<Creator&>::element_type, Creator>;
+
+// 任何可以Submit(void())的执行器，比如ThreadPool
+template <typename E>
+concept Executor = requires(E& executor, std::function<void()> task) { executor.Submit(task); };
+
+/**
+ * @brief 可以预取的异步代理.
+ *
+ * Prefetch在执行器上开始创建，GetObject只在对象还没创建好时等待，TryGet从不等待.
+ * 也可以通过GetFuture得到std::shared_future，或者在协程中co_await代理.
+ * 等待中的协程在创建对象的线程上恢复.
+ * 与ConcurrentProxy不同，创建失败是最终结果，之后的GetObject都会重新抛出同一个异常.
+ * 代理析构时会等待进行中的创建结束.
+ * @tparam T 被代理的类型
+ * @tparam Creator 返回std::unique_ptr<T>的可调用对象
+ * @tparam ExecutorType 执行器
+ */
+template <
+    typename T,
+    typename Creator      = std::unique_ptr<T> (*)(),
+    typename ExecutorType = ThreadPool>
+requires std::is_convertible_v<std::invoke_result_t<Creator&>, std::unique_ptr<T>> &&
+         Executor<ExecutorType>
+class AsyncProxy {
+    enum class State : unsigned char {
+        empty,
+        constructing,
+        ready,
+        failed
+    };
+
+public:
+    using value_type = T;
+    using self_type  = AsyncProxy;
+
+    class Awaiter {
+    public:
+        explicit Awaiter(AsyncProxy& proxy) noexcept : proxy_(proxy) {}
+
+        [[nodiscard]] bool await_ready() const noexcept { return proxy_.Done(); }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            proxy_.Prefetch();
+            auto lock = std::lock_guard{ proxy_.mutex_ };
+            if (proxy_.Done()) {
+                return false;
+            }
+            proxy_.waiters_.push_back(handle);
+            return true;
+        }
+
+        T* await_resume() const { return proxy_.Result(); }
+
+    private:
+        AsyncProxy& proxy_;
+    };
+
+    AsyncProxy(ExecutorType& executor, Creator creator)
+        : executor_(executor),
+          creator_(std::move(creator)),
+          future_(promise_.get_future().share()) {}
+
+    AsyncProxy(AsyncProxy const&)            = delete;
+    AsyncProxy& operator=(AsyncProxy const&) = delete;
+
+    virtual ~AsyncProxy() {
+        auto lock = std::unique_lock{ mutex_ };
+        condition_.wait(lock, [this]() {
+            return state_.load(std::memory_order_relaxed) != State::constructing;
+        });
+    }
+
+    // 在执行器上开始创建，已经开始或完成时什么也不做
+    void Prefetch() {
+        auto expected = State::empty;
+        if (state_.compare_exchange_strong(
+                expected, State::constructing, std::memory_order_acq_rel
+            )) {
+            executor_.Submit([this]() { Construct(); });
+        }
+    }
+
+    // 没有预取过时在当前线程上创建
+    [[nodiscard]] T* GetObject() {
+        if (auto* object = object_.load(std::memory_order_acquire)) {
+            return object;
+        }
+        auto expected = State::empty;
+        if (state_.compare_exchange_strong(
+                expected, State::constructing, std::memory_order_acq_rel
+            )) {
+            Construct();
+        }
+        else {
+            auto lock = std::unique_lock{ mutex_ };
+            condition_.wait(lock, [this]() { return Done(); });
+        }
+        return Result();
+    }
+
+    [[nodiscard]] T* TryGet() const noexcept { return object_.load(std::memory_order_acquire); }
+
+    [[nodiscard]] std::shared_future<T*> GetFuture() {
+        Prefetch();
+        return future_;
+    }
+
+    [[nodiscard]] Awaiter operator co_await() noexcept { return Awaiter{ *this }; }
+
+private:
+    [[nodiscard]] bool Done() const noexcept {
+        auto const state = state_.load(std::memory_order_acquire);
+        return state == State::ready || state == State::failed;
+    }
+
+    T* Result() const {
+        if (state_.load(std::memory_order_acquire) == State::failed) {
+            std::rethrow_exception(error_);
+        }
+        return object_.load(std::memory_order_acquire);
+    }
+
+    void Construct() {
+        auto object = std::unique_ptr<T>{};
+        auto error  = std::exception_ptr{};
+        try {
+            object = creator_();
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+
+        auto waiters = std::vector<std::coroutine_handle<>>{};
+        {
+            // 在锁内通知，解锁之后不再访问this，析构函数才能安全地返回
+            auto lock = std::lock_guard{ mutex_ };
+            if (error) {
+                error_ = error;
+                promise_.set_exception(error);
+                state_.store(State::failed, std::memory_order_release);
+            }
+            else {
+                owner_ = std::move(object);
+                object_.store(owner_.get(), std::memory_order_release);
+                promise_.set_value(owner_.get());
+                state_.store(State::ready, std::memory_order_release);
+            }
+            waiters.swap(waiters_);
+            condition_.notify_all();
+        }
+        for (auto waiter : waiters) {
+            waiter.resume();
+        }
+    }
+
+    ExecutorType& executor_;
+    [[no_unique_address]] Creator creator_;
+    std::unique_ptr<T> owner_;
+    std::exception_ptr error_;
+    std::atomic<T*> object_{ nullptr };
+    std::atomic<State> state_{ State::empty };
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::vector<std::coroutine_handle<>> waiters_;
+    std::promise<T*> promise_;
+    std::shared_future<T*> future_;
+};
+
+template <typename ExecutorType, typename Creator>
+AsyncProxy(ExecutorType&, Creator)
+    -> AsyncProxy<typename std::invoke_result_t<Creator&>::element_type, Creator, ExecutorType>;
+
+struct CacheStatistics {
+    std::uint64_t hits        = 0;
+    std::uint64_t misses      = 0;
+    std::uint64_t coalesced   = 0; // 未命中但等待了同一个键上进行中的计算
+    std::uint64_t evictions   = 0;
+    std::uint64_t expirations = 0;
+};
+
+struct CacheOptions {
+    std::size_t capacity    = 1024;
+    std::size_t byte_budget = static_cast<std::size_t>(-1);
+    // 为0时不过期
+    std::chrono::steady_clock::duration ttl = std::chrono::steady_clock::duration::zero();
+    // 判断过期用的时钟，测试中可以替换
+    std::chrono::steady_clock::time_point (*now)() = &std::chrono::steady_clock::now;
+};
+
+/**
+ * @brief 记忆化的缓存代理.
+ *
+ * 按键缓存function(key)的结果，按LRU淘汰，同时限制条目数和字节数，可选过期时间.
+ * 同一个键上同时发生的未命中只计算一次，其余调用者等待这次计算的结果.
+ * 结果以std::shared_ptr<Value const>返回，被淘汰之后仍然可以继续使用.
+ * function在锁外调用，抛出的异常传给这次计算的所有等待者，并且不缓存.
+ * Invalidate和Clear之前开始的计算仍然返回给它的等待者，但结果不会进入缓存.
+ * @tparam Key 键
+ * @tparam Value 值
+ * @tparam Function Value(Key const&)
+ * @tparam Hash 键的哈希
+ */
+template <
+    typename Key,
+    typename Value,
+    typename Function = std::function<Value(Key const&)>,
+    typename Hash     = std::hash<Key>>
+requires std::is_invocable_r_v<Value, Function&, Key const&>
+class CachingProxy {
+public:
+    using key_type     = Key;
+    using value_type   = Value;
+    using pointer_type = std::shared_ptr<Value const>;
+    using clock_type   = std::chrono::steady_clock;
+    using sizer_type   = std::size_t (*)(Key const&, Value const&);
+    using self_type    = CachingProxy;
+
+    explicit CachingProxy(Function function, CacheOptions options = {}, sizer_type sizer = nullptr)
+        : function_(std::move(function)), options_(options), sizer_(sizer) {}
+
+    CachingProxy(CachingProxy const&)            = delete;
+    CachingProxy& operator=(CachingProxy const&) = delete;
+
+    virtual ~CachingProxy() = default;
+
+    [[nodiscard]] pointer_type Get(Key const& key) {
+        auto promise    = std::promise<pointer_type>{};
+        auto generation = std::uint64_t{ 0 };
+        {
+            auto lock = std::unique_lock{ mutex_ };
+            if (auto iter = index_.find(key); iter != index_.end()) {
+                auto entry         = iter->second;
+                auto const expired = options_.ttl != clock_type::duration::zero() &&
+                                     options_.now() >= entry->expires;
+                if (!expired) {
+                    lru_.splice(lru_.begin(), lru_, entry);
+                    ++statistics_.hits;
+                    return entry->value;
+                }
+                ++statistics_.expirations;
+                Erase(entry);
+            }
+
+            ++statistics_.misses;
+            if (auto iter = in_flight_.find(key); iter != in_flight_.end()) {
+                ++statistics_.coalesced;
+                auto future = iter->second.future;
+                lock.unlock();
+                return future.get();
+            }
+            generation = generation_;
+            in_flight_.emplace(key, InFlight{ promise.get_future().share(), generation });
+        }
+
+        auto value = pointer_type{};
+        try {
+            value = std::make_shared<Value const>(function_(key));
+        }
+        catch (...) {
+            {
+                auto lock = std::lock_guard{ mutex_ };
+                Finish(key, generation);
+            }
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+
+        // 计算期间被Invalidate或Clear时不缓存这个已经过时的结果
+        if (auto lock = std::lock_guard{ mutex_ }; Finish(key, generation)) {
+            if (auto iter = index_.find(key); iter != index_.end()) {
+                Erase(iter->second);
+            }
+            auto const bytes = sizer_ ? sizer_(key, *value) : sizeof(Key) + sizeof(Value);
+            lru_.push_front(Entry{ key, value, bytes, options_.now() + options_.ttl });
+            index_.emplace(key, lru_.begin());
+            bytes_ += bytes;
+            while (lru_.size() > options_.capacity || bytes_ > options_.byte_budget) {
+                ++statistics_.evictions;
+                Erase(std::prev(lru_.end()));
+                if (lru_.empty()) {
+                    break;
+                }
+            }
+        }
+        promise.set_value(value);
+        return value;
+    }
+
+    // 之后的调用不会再等待进行中的计算，而是重新计算
+    void Invalidate(Key const& key) {
+        auto lock = std::lock_guard{ mutex_ };
+        if (auto iter = index_.find(key); iter != index_.end()) {
+            Erase(iter->second);
+        }
+        in_flight_.erase(key);
+        ++generation_;
+    }
+
+    void Clear() {
+        auto lock = std::lock_guard{ mutex_ };
+        index_.clear();
+        lru_.clear();
+        in_flight_.clear();
+        bytes_ = 0;
+        ++generation_;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        auto lock = std::lock_guard{ mutex_ };
+        return lru_.size();
+    }
+
+    [[nodiscard]] std::size_t Bytes() const {
+        auto lock = std::lock_guard{ mutex_ };
+        return bytes_;
+    }
+
+    [[nodiscard]] CacheStatistics GetStatistics() const {
+        auto lock = std::lock_guard{ mutex_ };
+        return statistics_;
+    }
+
+private:
+    struct Entry {
+        Key key;
+        pointer_type value;
+        std::size_t bytes;
+        clock_type::time_point expires;
+    };
+
+    using entry_iterator = typename std::list<Entry>::iterator;
+
+    // generation是计算开始时的generation_，用来区分同一个键上失效前后的计算
+    struct InFlight {
+        std::shared_future<pointer_type> future;
+        std::uint64_t generation;
+    };
+
+    // 计算结束时移除自己的记录；记录已经被Invalidate或Clear移除时返回false
+    bool Finish(Key const& key, std::uint64_t generation) {
+        auto iter = in_flight_.find(key);
+        if (iter == in_flight_.end() || iter->second.generation != generation) {
+            return false;
+        }
+        in_flight_.erase(iter);
+        return true;
+    }
+
+    void Erase(entry_iterator entry) {
+        bytes_ -= entry->bytes;
+        index_.erase(entry->key);
+        lru_.erase(entry);
+    }
+
+    [[no_unique_address]] Function function_;
+    CacheOptions options_;
+    sizer_type sizer_;
+
+    mutable std::mutex mutex_;
+    std::list<Entry> lru_;
+    std::unordered_map<Key, entry_iterator, Hash> index_;
+    std::unordered_map<Key, InFlight, Hash> in_flight_;
+    std::uint64_t generation_ = 0;
+    std::size_t bytes_        = 0;
+    CacheStatistics statistics_;
+};
+} // namespace proxy
+
+namespace iterator {
+
+// 钩子可以是私有的，这时派生类需要把IteratorAccess声明为友元
+class IteratorAccess {
+    template <typename, typename, typename, typename, typename>
+    friend class Iterator;
+
+    template <typename I>
+    static constexpr decltype(auto) Dereference(I const& iter) {
+        return iter.dereference();
+    }
+    template <typename I>
+    static constexpr void Increment(I& iter) {
+        iter.increment();
+    }
+    template <typename I>
+    static constexpr void Decrement(I& iter) {
+        iter.decrement();
+    }
+    template <typename I>
+    static constexpr bool Equal(I const& lhs, I const& rhs) {
+        return lhs.equal(rhs);
+    }
+    template <typename I, typename Distance>
+    static constexpr void Advance(I& iter, Distance n) {
+        iter.advance(n);
+    }
+    template <typename I>
+    static constexpr auto DistanceTo(I const& from, I const& to) {
+        return from.distance_to(to);
+    }
+};
+
+/**
+ * @brief 迭代器门面，参考C++ Templates 2nd.
+ *
+ * 没有虚函数，派生类通过CRTP提供钩子，门面据此生成完整的运算符：
+ * - 前向：dereference() const, increment(), equal(Derived const&) const
+ * - 双向：再加上decrement()
+ * - 随机访问/连续：再加上advance(difference_type), distance_to(Derived const&) const（返回other - this）
+ * 派生类需要可以默认构造，才能满足std::forward_iterator.
+ * @tparam Derived 派生的迭代器
+ * @tparam Value 元素类型
+ * @tparam Category 从std::forward_iterator_tag到std::contiguous_iterator_tag
+ * @tparam Reference dereference()返回的类型
+ * @tparam Distance 距离
+ */
+template <
+    typename Derived,
+    typename Value,
+    typename Category,
+    typename Reference = Value&,
+    typename Distance  = std::ptrdiff_t>
+class Iterator {
+    static constexpr bool bidirectional =
+        std::derived_from<Category, std::bidirectional_iterator_tag>;
+    static constexpr bool random_access =
+        std::derived_from<Category, std::random_access_iterator_tag>;
+
+public:
+    using value_type       = std::remove_cv_t<Value>;
+    using self_type        = Iterator;
+    using reference        = Reference;
+    using pointer          = std::conditional_t<
+        std::is_lvalue_reference_v<Reference>,
+        Value*,
+        void>;
+    using difference_type  = Distance;
+    using iterator_concept = Category;
+    // 传统的迭代器类别中没有contiguous_iterator_tag
+    using iterator_category =
+        std::conditional_t<random_access, std::random_access_iterator_tag, Category>;
+
+    // input
+    constexpr reference operator*() const { return IteratorAccess::Dereference(AsDerived()); }
+
+    constexpr pointer operator->() const
+    requires std::is_lvalue_reference_v<Reference>
+    {
+        return std::addressof(**this);
+    }
+
+    constexpr Derived& operator++() {
+        IteratorAccess::Increment(AsDerived());
+        return AsDerived();
+    }
+
+    constexpr Derived operator++(int) {
+        auto result = AsDerived();
+        ++*this;
+        return result;
+    }
+
+    friend constexpr bool operator==(Derived const& lhs, Derived const& rhs) {
+        return lhs.EqualTo(rhs);
+    }
+
+    // both
+    constexpr Derived& operator--()
+    requires bidirectional
+    {
+        IteratorAccess::Decrement(AsDerived());
+        return AsDerived();
+    }
+
+    constexpr Derived operator--(int)
+    requires bidirectional
+    {
+        auto result = AsDerived();
+        --*this;
+        return result;
+    }
+
+    // random
+    constexpr reference operator[](difference_type n) const
+    requires random_access
+    {
+        return *(AsDerived() + n);
+    }
+
+    constexpr Derived& operator+=(difference_type n)
+    requires random_access
+    {
+        IteratorAccess::Advance(AsDerived(), n);
+        return AsDerived();
+    }
+
+    constexpr Derived& operator-=(difference_type n)
+    requires random_access
+    {
+        IteratorAccess::Advance(AsDerived(), -n);
+        return AsDerived();
+    }
+
+    friend constexpr Derived operator+(Derived iter, difference_type n)
+    requires random_access
+    {
+        return iter += n;
+    }
+
+    friend constexpr Derived operator+(difference_type n, Derived iter)
+    requires random_access
+    {
+        return iter += n;
+    }
+
+    friend constexpr Derived operator-(Derived iter, difference_type n)
+    requires random_access
+    {
+        return iter -= n;
+    }
+
+    friend constexpr difference_type operator-(Derived const& lhs, Derived const& rhs)
+    requires random_access
+    {
+        return rhs.DistanceTo(lhs);
+    }
+
+    friend constexpr std::strong_ordering operator<=>(Derived const& lhs, Derived const& rhs)
+    requires random_access
+    {
+        return rhs.DistanceTo(lhs) <=> difference_type{ 0 };
+    }
+
+protected:
+    Iterator() = default;
+
+private:
+    [[nodiscard]] constexpr Derived& AsDerived() noexcept { return static_cast<Derived&>(*this); }
+    [[nodiscard]] constexpr Derived const& AsDerived() const noexcept {
+        return static_cast<Derived const&>(*this);
+    }
+
+    // 友元运算符不是IteratorAccess的友元，经由这里转发
+    [[nodiscard]] constexpr bool EqualTo(Derived const& other) const {
+        return IteratorAccess::Equal(AsDerived(), other);
+    }
+    [[nodiscard]] constexpr difference_type DistanceTo(Derived const& other) const {
+        return IteratorAccess::DistanceTo(AsDerived(), other);
+    }
+};
+
+/**
+ * @brief 可以拆分的区间，供并行算法把一个区间分给多个线程.
+ *
+ * 区间记录自己的长度，拆分时不需要重新数一遍.
+ * 随机访问迭代器O(1)拆分；前向迭代器拆分需要走到拆分点，适合按固定大小从前面切下一块.
+ * @tparam I 迭代器
+ */
+template <std::forward_iterator I>
+class SplittableRange : public std::ranges::view_interface<SplittableRange<I>> {
+public:
+    using iterator        = I;
+    using difference_type = std::iter_difference_t<I>;
+    using self_type       = SplittableRange;
+
+    SplittableRange() = default;
+    SplittableRange(I first, I last)
+        : first_(first), last_(last), size_(std::ranges::distance(first, last)) {}
+    // size是已知的长度，避免前向迭代器再数一遍
+    SplittableRange(I first, I last, difference_type size)
+        : first_(first), last_(last), size_(size) {}
+
+    template <std::ranges::forward_range Range>
+    requires std::same_as<std::ranges::iterator_t<Range>, I>
+    explicit SplittableRange(Range&& range) : first_(std::ranges::begin(range)) {
+        if constexpr (std::ranges::common_range<Range>) {
+            last_ = std::ranges::end(range);
+            size_ = std::ranges::distance(range);
+        }
+        else {
+            last_ = std::ranges::next(first_, std::ranges::end(range));
+            size_ = std::ranges::distance(first_, last_);
+        }
+    }
+
+    [[nodiscard]] I begin() const { return first_; }
+    [[nodiscard]] I end() const { return last_; }
+    [[nodiscard]] std::size_t size() const noexcept { return static_cast<std::size_t>(size_); }
+
+    // 长度超过grain时才值得拆分
+    [[nodiscard]] bool IsDivisible(std::size_t grain) const noexcept { return size() > grain; }
+
+    // 拆成[0, count)和[count, size)
+    [[nodiscard]] std::pair<SplittableRange, SplittableRange> SplitAt(difference_type count) const {
+        auto const middle = std::ranges::next(first_, count);
+        return { SplittableRange{ first_, middle, count },
+                 SplittableRange{ middle, last_, size_ - count } };
+    }
+
+    // 对半拆分
+    [[nodiscard]] std::pair<SplittableRange, SplittableRange> Split() const {
+        return SplitAt(size_ / 2);
+    }
+
+private:
+    I first_{};
+    I last_{};
+    difference_type size_ = 0;
+};
+
+template <std::ranges::forward_range Range>
+SplittableRange(Range&&) -> SplittableRange<std::ranges::iterator_t<Range>>;
+
+namespace detail {
+// 默认每个线程大约分到8块，给工作窃取留出余地
+inline std::size_t DefaultGrain(ThreadPool const& pool, std::size_t size) noexcept {
+    return std::max<std::size_t>(size / (pool.size() * 8), 1);
+}
+
+template <typename I, typename Function>
+void ForEachSplit(
+    TaskGroup& group,
+    SplittableRange<I> range,
+    Function& function,
+    std::size_t grain
+) {
+    if constexpr (std::random_access_iterator<I>) {
+        // 左半交给线程池继续拆分，右半留在当前线程
+        while (range.IsDivisible(grain)) {
+            auto [left, right] = range.Split();
+            group.Run([&group, left = left, &function, grain]() {
+                ForEachSplit(group, left, function, grain);
+            });
+            range = right;
+        }
+    }
+    else {
+        // 前向迭代器只走一遍，依次切下grain大小的块
+        while (range.IsDivisible(grain)) {
+            auto [chunk, rest] = range.SplitAt(static_cast<std::iter_difference_t<I>>(grain));
+            group.Run([chunk = chunk, &function]() {
+                for (auto&& element : chunk) {
+                    function(element);
+                }
+            });
+            range = rest;
+        }
+    }
+    for (auto&& element : range) {
+        function(element);
+    }
+}
+
+// 区间非空，第一个元素作为初值，所以整体的init只会用一次
+template <typename T, typename I, typename Reduce, typename Transform>
+T TransformReduceChunk(SplittableRange<I> range, Reduce& reduce, Transform& transform) {
+    auto first  = range.begin();
+    auto result = static_cast<T>(std::invoke(transform, *first));
+    for (++first; first != range.end(); ++first) {
+        result = std::invoke(reduce, std::move(result), std::invoke(transform, *first));
+    }
+    return result;
+}
+
+template <typename T, typename I, typename Reduce, typename Transform>
+T TransformReduceSplit(
+    ThreadPool& pool,
+    SplittableRange<I> range,
+    Reduce& reduce,
+    Transform& transform,
+    std::size_t grain
+) {
+    if (!range.IsDivisible(grain)) {
+        return TransformReduceChunk<T>(range, reduce, transform);
+    }
+    auto [left, right] = range.Split();
+    auto left_result   = std::optional<T>{};
+    auto group         = TaskGroup{ pool };
+    group.Run([&, left = left]() {
+        left_result.emplace(TransformReduceSplit<T>(pool, left, reduce, transform, grain));
+    });
+    auto right_result = TransformReduceSplit<T>(pool, right, reduce, transform, grain);
+    group.Wait();
+    return std::invoke(reduce, std::move(*left_result), std::move(right_result));
+}
+} // namespace detail
+
+/**
+ * @brief 在线程池上对区间的每个元素调用function，不保证顺序.
+ *
+ * 区间不会被复制到std::vector中，迭代器需要可以在线程间复制使用.
+ * @param pool 线程池
+ * @param range 前向区间
+ * @param function 元素 -> void
+ * @param grain 每块的最少元素数，0表示自动选择
+ */
+template <std::ranges::forward_range Range, typename Function>
+void ParallelForEach(ThreadPool& pool, Range&& range, Function&& function, std::size_t grain = 0) {
+    auto splittable = SplittableRange{ range };
+    if (grain == 0) {
+        grain = detail::DefaultGrain(pool, splittable.size());
+    }
+    auto group = TaskGroup{ pool };
+    detail::ForEachSplit(group, splittable, function, grain);
+    group.Wait();
+}
+
+/**
+ * @brief 在线程池上并行地计算reduce(init, transform(元素)...).
+ *
+ * 块内按顺序归约，块之间按区间中的顺序合并，所以reduce只需要满足结合律.
+ * @param pool 线程池
+ * @param range 前向区间
+ * @param init 初值
+ * @param reduce (T, T) -> T
+ * @param transform 元素 -> T
+ * @param grain 每块的最少元素数，0表示自动选择
+ */
+template <std::ranges::forward_range Range, typename T, typename Reduce, typename Transform>
+T ParallelTransformReduce(
+    ThreadPool& pool,
+    Range&& range,
+    T init,
+    Reduce reduce,
+    Transform transform,
+    std::size_t grain = 0
+) {
+    auto splittable = SplittableRange{ range };
+    if (splittable.empty()) {
+        return init;
+    }
+    if (grain == 0) {
+        grain = detail::DefaultGrain(pool, splittable.size());
+    }
+
+    if constexpr (std::ranges::random_access_range<Range>) {
+        auto result = detail::TransformReduceSplit<T>(pool, splittable, reduce, transform, grain);
+        return std::invoke(reduce, std::move(init), std::move(result));
+    }
+    else {
+        auto results = std::vector<std::optional<T>>((splittable.size() + grain - 1) / grain);
+        auto group   = TaskGroup{ pool };
+        for (auto& result : results) {
+            auto chunk = splittable;
+            if (splittable.IsDivisible(grain)) {
+                std::tie(chunk, splittable) = splittable.SplitAt(
+                    static_cast<std::ranges::range_difference_t<Range>>(grain)
+                );
+            }
+            group.Run([&result, chunk, &reduce, &transform]() {
+                result.emplace(detail::TransformReduceChunk<T>(chunk, reduce, transform));
+            });
+        }
+        group.Wait();
+        for (auto& result : results) {
+            init = std::invoke(reduce, std::move(init), std::move(*result));
+        }
+        return init;
+    }
+}
+} // namespace iterator
+
+namespace composite {
+// 遍历时默认内联的深度，更深的树才会用到堆
+inline constexpr std::size_t kInlineDepth = 16;
+
+/**
+ * @brief 先序遍历迭代器.
+ *
+ * 显式的栈中只保存每一层还没有访问的兄弟节点区间，不会递归，也不会预先收集节点.
+ * 遍历期间不能修改树的结构.
+ */
+template <typename T, std::size_t InlineDepth = kInlineDepth>
+class PreOrderIterator
+    : public iterator::
+          Iterator<PreOrderIterator<T, InlineDepth>, Component<T>, std::forward_iterator_tag> {
+    friend class iterator::IteratorAccess;
+
+    using child_pointer = std::shared_ptr<Component<T>> const*;
+
+    struct Frame {
+        child_pointer next = nullptr;
+        child_pointer end  = nullptr;
+    };
+
+public:
+    PreOrderIterator() = default;
+    explicit PreOrderIterator(Component<T>* root) : current_(root) {}
+
+private:
+    Component<T>& dereference() const { return *current_; }
+
+    bool equal(PreOrderIterator const& other) const { return current_ == other.current_; }
+
+    void increment() {
+        if (auto const children = current_->Children(); !children.empty()) {
+            if (children.size() > 1) {
+                stack_.Push({ children.data() + 1, children.data() + children.size() });
+            }
+            current_ = children.front().get();
+            return;
+        }
+        if (stack_.empty()) {
+            current_ = nullptr;
+            return;
+        }
+        auto& frame = stack_.Top();
+        current_    = (frame.next++)->get();
+        if (frame.next == frame.end) {
+            stack_.Pop();
+        }
+    }
+
+    Component<T>* current_ = nullptr;
+    memory::SmallStack<Frame, InlineDepth> stack_;
+};
+
+/**
+ * @brief 后序遍历迭代器.
+ *
+ * 栈中保存从根到当前节点的路径以及每层下一个要访问的子节点，当前节点总在栈顶.
+ * 遍历期间不能修改树的结构.
+ */
+template <typename T, std::size_t InlineDepth = kInlineDepth>
+class PostOrderIterator
+    : public iterator::
+          Iterator<PostOrderIterator<T, InlineDepth>, Component<T>, std::forward_iterator_tag> {
+    friend class iterator::IteratorAccess;
+
+    using child_pointer = std::shared_ptr<Component<T>> const*;
+
+    struct Frame {
+        Component<T>* node = nullptr;
+        child_pointer next = nullptr;
+        child_pointer end  = nullptr;
+    };
+
+public:
+    PostOrderIterator() = default;
+    explicit PostOrderIterator(Component<T>* root) {
+        if (root != nullptr) {
+            Descend(root);
+        }
+    }
+
+private:
+    Component<T>& dereference() const { return *stack_.Top().node; }
+
+    bool equal(PostOrderIterator const& other) const { return Current() == other.Current(); }
+
+    void increment() {
+        stack_.Pop();
+        if (stack_.empty()) {
+            return;
+        }
+        if (auto& frame = stack_.Top(); frame.next != frame.end) {
+            Descend((frame.next++)->get());
+        }
+    }
+
+    // 沿着第一个子节点一直走到叶子
+    void Descend(Component<T>* node) {
+        while (true) {
+            auto const children = node->Children();
+            stack_.Push({ node, children.data(), children.data() + children.size() });
+            if (children.empty()) {
+                return;
+            }
+            node = (stack_.Top().next++)->get();
+        }
+    }
+
+    [[nodiscard]] Component<T>* Current() const noexcept {
+        return stack_.empty() ? nullptr : stack_.Top().node;
+    }
+
+    memory::SmallStack<Frame, InlineDepth> stack_;
+};
+
+/**
+ * @brief 广度优先遍历迭代器.
+ *
+ * 队列中保存的是还没有访问的兄弟节点区间，而不是节点本身.
+ * 遍历期间不能修改树的结构.
+ */
+template <typename T>
+class BreadthFirstIterator
+    : public iterator::Iterator<BreadthFirstIterator<T>, Component<T>, std::forward_iterator_tag> {
+    friend class iterator::IteratorAccess;
+
+    using child_pointer = std::shared_ptr<Component<T>> const*;
+
+    struct Frame {
+        child_pointer next = nullptr;
+        child_pointer end  = nullptr;
+    };
+
+public:
+    BreadthFirstIterator() = default;
+    explicit BreadthFirstIterator(Component<T>* root) : current_(root) {}
+
+private:
+    Component<T>& dereference() const { return *current_; }
+
+    bool equal(BreadthFirstIterator const& other) const { return current_ == other.current_; }
+
+    void increment() {
+        if (auto const children = current_->Children(); !children.empty()) {
+            queue_.push_back({ children.data(), children.data() + children.size() });
+        }
+        if (queue_.empty()) {
+            current_ = nullptr;
+            return;
+        }
+        auto& frame = queue_.front();
+        current_    = (frame.next++)->get();
+        if (frame.next == frame.end) {
+            queue_.pop_front();
+        }
+    }
+
+    Component<T>* current_ = nullptr;
+    std::deque<Frame> queue_;
+};
+
+/**
+ * @brief 惰性的遍历视图，可以与std::views::filter/transform组合.
+ *
+ * 视图只保存根节点的指针，迭代器不依赖视图本身.
+ * @tparam Iterator 上面的遍历迭代器之一
+ */
+template <typename Iterator>
+class TraversalView : public std::ranges::view_interface<TraversalView<Iterator>> {
+public:
+    using iterator  = Iterator;
+    using self_type = TraversalView;
+
+    TraversalView() = default;
+    template <typename T>
+    explicit TraversalView(Component<T>& root) : root_(std::addressof(root)) {}
+
+    [[nodiscard]] iterator begin() const { return iterator{ root_ }; }
+    [[nodiscard]] iterator end() const { return iterator{}; }
+
+private:
+    std::remove_reference_t<std::iter_reference_t<Iterator>>* root_ = nullptr;
+};
+
+template <typename T>
+[[nodiscard]] TraversalView<PreOrderIterator<T>> PreOrder(Component<T>& root) {
+    return TraversalView<PreOrderIterator<T>>{ root };
+}
+
+template <typename T>
+[[nodiscard]] TraversalView<PostOrderIterator<T>> PostOrder(Component<T>& root) {
+    return TraversalView<PostOrderIterator<T>>{ root };
+}
+
+template <typename T>
+[[nodiscard]] TraversalView<BreadthFirstIterator<T>> BreadthFirst(Component<T>& root) {
+    return TraversalView<BreadthFirstIterator<T>>{ root };
+}
+} // namespace composite
+
+namespace visitor {
+template <typename T>
+class Element {
+public:
+    using value_type = T;
+    using self_type  = Element;
+
+    virtual ~Element() = default;
+
+protected:
+    Element() = default;
+};
+
+template <typename T>
+class Visitor {
+    using value_type = T;
+    using self_type  = Visitor;
+};
+
+// 把多个lambda合成一个重载集合
+template <typename... Functions>
+struct Overloaded : Functions... {
+    using Functions::operator()...;
+};
+
+template <typename... Functions>
+Overloaded(Functions...) -> Overloaded<Functions...>;
+
+namespace detail {
+template <typename Result, std::size_t Index, typename Visitor, typename Variant>
+Result VisitAlternative(Visitor& visitor, Variant& element) {
+    // 下标已经由跳转表保证，不需要std::get的检查
+    return static_cast<Result>(std::invoke(visitor, *std::get_if<Index>(&element)));
+}
+
+template <typename Visitor, typename Variant, typename Indices>
+struct VisitTable;
+
+template <typename Visitor, typename Variant, std::size_t... Indices>
+struct VisitTable<Visitor, Variant, std::index_sequence<Indices...>> {
+    using result_type = std::common_type_t<
+        std::invoke_result_t<Visitor&, std::variant_alternative_t<Indices, Variant>&>...>;
+
+    // 每种元素一个函数指针，按variant的下标排列
+    static constexpr std::array<result_type (*)(Visitor&, Variant&), sizeof...(Indices)> table{
+        &VisitAlternative<result_type, Indices, Visitor, Variant>...
+    };
+};
+
+template <typename Visitor, typename Variant>
+using VisitTableFor =
+    VisitTable<Visitor, Variant, std::make_index_sequence<std::variant_size_v<Variant>>>;
+
+// 超过这个数量的元素类型才使用函数指针表
+inline constexpr std::size_t kMaxInlineAlternatives = 8;
+
+// 元素类型不多时展开成比较链，编译器可以把visitor内联进来，通常还会生成switch跳转表
+template <typename Result, std::size_t Index, typename Visitor, typename Variant>
+Result VisitFrom(Visitor& visitor, Variant& element) {
+    if constexpr (Index + 1 == std::variant_size_v<Variant>) {
+        return VisitAlternative<Result, Index>(visitor, element);
+    }
+    else {
+        if (element.index() == Index) {
+            return VisitAlternative<Result, Index>(visitor, element);
+        }
+        return VisitFrom<Result, Index + 1>(visitor, element);
+    }
+}
+
+template <typename Visitor, typename Variant>
+auto Accept(Variant& element, Visitor& visitor) ->
+    typename VisitTableFor<Visitor, Variant>::result_type {
+    using result_type = typename VisitTableFor<Visitor, Variant>::result_type;
+
+    if (element.valueless_by_exception()) {
+        throw std::bad_variant_access{};
+    }
+    if constexpr (std::variant_size_v<Variant> <= kMaxInlineAlternatives) {
+        return VisitFrom<result_type, 0>(visitor, element);
+    }
+    else {
+        return VisitTableFor<Visitor, Variant>::table[element.index()](visitor, element);
+    }
+}
+} // namespace detail
+
+/**
+ * @brief 用visitor访问封闭集合中的一个元素.
+ *
+ * 通过编译期生成的函数指针表按下标分派，元素和visitor都不需要虚函数.
+ * visitor需要能处理每一种元素，返回类型是各个重载返回类型的std::common_type.
+ * @param element 元素
+ * @param visitor 重载集合，例如Overloaded{...}
+ */
+template <typename Visitor, typename... Elements>
+decltype(auto) Accept(std::variant<Elements...>& element, Visitor&& visitor) {
+    return detail::Accept(element, visitor);
+}
+
+template <typename Visitor, typename... Elements>
+decltype(auto) Accept(std::variant<Elements...> const& element, Visitor&& visitor) {
+    return detail::Accept(element, visitor);
+}
+
+/**
+ * @brief 元素类型封闭的容器，元素按值存放在std::variant中，不会被切割.
+ *
+ * @tparam Elements 所有的元素类型
+ */
+template <typename... Elements>
+class ElementSet {
+public:
+    using value_type     = std::variant<Elements...>;
+    using iterator       = typename std::vector<value_type>::iterator;
+    using const_iterator = typename std::vector<value_type>::const_iterator;
+    using self_type      = ElementSet;
+
+    template <typename Element, typename... Args>
+    requires(std::same_as<Element, Elements> || ...)
+    Element& Add(Args&&... args) {
+        auto& element =
+            elements_.emplace_back(std::in_place_type<Element>, std::forward<Args>(args)...);
+        return *std::get_if<Element>(&element);
+    }
+
+    // 依次访问每个元素，visitor可以是有状态的
+    template <typename Visitor>
+    void Accept(Visitor&& visitor) {
+        for (auto& element : elements_) {
+            detail::Accept(element, visitor);
+        }
+    }
+
+    template <typename Visitor>
+    void Accept(Visitor&& visitor) const {
+        for (auto const& element : elements_) {
+            detail::Accept(element, visitor);
+        }
+    }
+
+    void Reserve(std::size_t capacity) { elements_.reserve(capacity); }
+    void Clear() noexcept { elements_.clear(); }
+
+    [[nodiscard]] std::size_t size() const noexcept { return elements_.size(); }
+    [[nodiscard]] bool empty() const noexcept { return elements_.empty(); }
+
+    [[nodiscard]] iterator begin() noexcept { return elements_.begin(); }
+    [[nodiscard]] iterator end() noexcept { return elements_.end(); }
+    [[nodiscard]] const_iterator begin() const noexcept { return elements_.begin(); }
+    [[nodiscard]] const_iterator end() const noexcept { return elements_.end(); }
+
+private:
+    std::vector<value_type> elements_;
+};
+
+/**
+ * @brief 按类型分桶的元素容器，每种元素一个连续的数组.
+ *
+ * 不保留元素之间的相对顺序.VisitAll逐桶访问，桶内是没有分派的紧凑循环；
+ * VisitSpans对能接受std::span<T>的桶只调用一次，方便向量化，其余的桶仍然逐个元素访问.
+ * @tparam Elements 所有的元素类型，不能重复
+ */
+template <typename... Elements>
+class BucketSet {
+    template <typename Element>
+    static constexpr bool contains = (std::same_as<Element, Elements> || ...);
+
+public:
+    using self_type = BucketSet;
+
+    template <typename Element, typename... Args>
+    requires contains<Element>
+    Element& Add(Args&&... args) {
+        return Bucket<Element>().emplace_back(std::forward<Args>(args)...);
+    }
+
+    template <typename Element>
+    requires contains<Element>
+    [[nodiscard]] std::span<Element> Get() noexcept {
+        return Bucket<Element>();
+    }
+
+    template <typename Element>
+    requires contains<Element>
+    [[nodiscard]] std::span<Element const> Get() const noexcept {
+        return Bucket<Element>();
+    }
+
+    template <typename Element>
+    requires contains<Element>
+    void Reserve(std::size_t capacity) {
+        Bucket<Element>().reserve(capacity);
+    }
+
+    template <typename Visitor>
+    void VisitAll(Visitor&& visitor) {
+        (VisitBucket<false>(Bucket<Elements>(), visitor), ...);
+    }
+
+    template <typename Visitor>
+    void VisitAll(Visitor&& visitor) const {
+        (VisitBucket<false>(Bucket<Elements>(), visitor), ...);
+    }
+
+    // 泛型的visitor也能接受span，所以按桶访问必须显式选择
+    template <typename Visitor>
+    void VisitSpans(Visitor&& visitor) {
+        (VisitBucket<true>(Bucket<Elements>(), visitor), ...);
+    }
+
+    template <typename Visitor>
+    void VisitSpans(Visitor&& visitor) const {
+        (VisitBucket<true>(Bucket<Elements>(), visitor), ...);
+    }
+
+    void Clear() noexcept { (Bucket<Elements>().clear(), ...); }
+
+    [[nodiscard]] std::size_t size() const noexcept { return (Bucket<Elements>().size() + ...); }
+    [[nodiscard]] bool empty() const noexcept { return size() == 0; }
+
+private:
+    static_assert(meta::IsUnique<Elements...>, "element types must be distinct");
+
+    template <typename Element>
+    std::vector<Element>& Bucket() noexcept {
+        return std::get<std::vector<Element>>(buckets_);
+    }
+
+    template <typename Element>
+    std::vector<Element> const& Bucket() const noexcept {
+        return std::get<std::vector<Element>>(buckets_);
+    }
+
+    template <bool Spans, typename Vector, typename Visitor>
+    static void VisitBucket(Vector& bucket, Visitor& visitor) {
+        using element_type = std::remove_reference_t<decltype(bucket[0])>;
+        // 用conjunction短路，VisitAll不去实例化泛型visitor的span调用
+        using spans = std::conjunction<
+            std::bool_constant<Spans>,
+            std::is_invocable<Visitor&, std::span<element_type>>>;
+        if constexpr (spans::value) {
+            std::invoke(visitor, std::span<element_type>{ bucket });
+        }
+        else {
+            for (auto& element : bucket) {
+                std::invoke(visitor, element);
+            }
+        }
+    }
+
+    std::tuple<std::vector<Elements>...> buckets_;
+};
+} // namespace visitor
+
+namespace strategy {
+// InplaceFunction默认的内联容量
+inline constexpr std::size_t kInplaceCapacity = 32;
+
+namespace detail {
+// C++23的std::invoke_r
+template <typename Ret, typename F, typename... Args>
+constexpr Ret InvokeR(F&& function, Args&&... args) {
+    if constexpr (std::is_void_v<Ret>) {
+        std::invoke(std::forward<F>(function), std::forward<Args>(args)...);
+    }
+    else {
+        return std::invoke(std::forward<F>(function), std::forward<Args>(args)...);
+    }
+}
+} // namespace detail
+
+template <typename Signature, std::size_t Capacity = kInplaceCapacity>
+class InplaceFunction;
+
+/**
+ * @brief 可调用对象存放在内部固定大小缓冲区中的std::function，永远不会分配堆内存.
+ *
+ * 放不下的可调用对象在编译期报错.可调用对象需要可以复制，并且移动不抛异常.
+ * 调用空的InplaceFunction抛出std::bad_function_call.
+ * @tparam Capacity 缓冲区字节数
+ */
+template <typename Ret, typename... Args, std::size_t Capacity>
+class InplaceFunction<Ret(Args...), Capacity> {
+public:
+    using result_type = Ret;
+    using self_type   = InplaceFunction;
+
+    InplaceFunction() noexcept = default;
+    InplaceFunction(std::nullptr_t) noexcept {}
+
+    template <typename F>
+    requires(!std::same_as<std::remove_cvref_t<F>, InplaceFunction>) &&
+            std::is_invocable_r_v<Ret, std::decay_t<F>&, Args...>
+    InplaceFunction(F&& function) {
+        using function_type = std::decay_t<F>;
+        static_assert(sizeof(function_type) <= Capacity, "callable is too large for the buffer");
+        static_assert(alignof(function_type) <= alignof(std::max_align_t));
+        static_assert(std::is_nothrow_move_constructible_v<function_type>);
+
+        ::new (static_cast<void*>(storage_)) function_type(std::forward<F>(function));
+        ops_ = &kOps<function_type>;
+    }
+
+    InplaceFunction(InplaceFunction const& other) : ops_(other.ops_) {
+        ops_->copy(other.storage_, storage_);
+    }
+
+    InplaceFunction(InplaceFunction&& other) noexcept : ops_(other.ops_) {
+        ops_->move(other.storage_, storage_);
+        other.ops_ = &kEmpty;
+    }
+
+    InplaceFunction& operator=(InplaceFunction const& other) {
+        if (this != &other) {
+            *this = InplaceFunction{ other };
+        }
+        return *this;
+    }
+
+    InplaceFunction& operator=(InplaceFunction&& other) noexcept {
+        if (this != &other) {
+            ops_->destroy(storage_);
+            ops_ = std::exchange(other.ops_, &kEmpty);
+            ops_->move(other.storage_, storage_);
+        }
+        return *this;
+    }
+
+    ~InplaceFunction() { ops_->destroy(storage_); }
+
+    Ret operator()(Args... args) const {
+        return ops_->invoke(storage_, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const noexcept { return ops_ != &kEmpty; }
+
+private:
+    struct Ops {
+        Ret (*invoke)(void*, Args&&...);
+        void (*copy)(void const*, void*);
+        void (*move)(void*, void*) noexcept;
+        void (*destroy)(void*) noexcept;
+    };
+
+    static constexpr Ops kEmpty{
+        [](void*, Args&&...) -> Ret { throw std::bad_function_call{}; },
+        [](void const*, void*) {},
+        [](void*, void*) noexcept {},
+        [](void*) noexcept {},
+    };
+
+    template <typename F>
+    static constexpr Ops kOps{
+        [](void* self, Args&&... args) -> Ret {
+            return detail::InvokeR<Ret>(*static_cast<F*>(self), std::forward<Args>(args)...);
+        },
+        [](void const* from, void* to) { ::new (to) F(*static_cast<F const*>(from)); },
+        [](void* from, void* to) noexcept {
+            ::new (to) F(std::move(*static_cast<F*>(from)));
+            std::destroy_at(static_cast<F*>(from));
+        },
+        [](void* self) noexcept { std::destroy_at(static_cast<F*>(self)); },
+    };
+
+    alignas(std::max_align_t) mutable std::byte storage_[Capacity];
+    Ops const* ops_ = &kEmpty;
+};
+
+template <typename Signature>
+class FunctionRef;
+
+/**
+ * @brief 不拥有可调用对象的引用，只有两个指针大小.
+ *
+ * 被引用的可调用对象必须比FunctionRef活得更久.
+ * 调用默认构造的FunctionRef抛出std::bad_function_call.
+ */
+template <typename Ret, typename... Args>
+class FunctionRef<Ret(Args...)> {
+public:
+    using result_type = Ret;
+    using self_type   = FunctionRef;
+
+    FunctionRef() noexcept = default;
+
+    template <typename F>
+    requires(!std::same_as<std::remove_cvref_t<F>, FunctionRef>) &&
+            std::is_invocable_r_v<Ret, F&, Args...>
+    FunctionRef(F&& function) noexcept {
+        using function_type = std::remove_reference_t<F>;
+        if constexpr (std::is_function_v<function_type>) {
+            target_.function = reinterpret_cast<void (*)()>(std::addressof(function));
+            invoke_          = [](Target target, Args&&... args) -> Ret {
+                return detail::InvokeR<Ret>(
+                    reinterpret_cast<function_type*>(target.function), std::forward<Args>(args)...
+                );
+            };
+        }
+        else {
+            target_.object = const_cast<void*>(static_cast<void const*>(std::addressof(function)));
+            invoke_        = [](Target target, Args&&... args) -> Ret {
+                return detail::InvokeR<Ret>(
+                    *static_cast<function_type*>(target.object), std::forward<Args>(args)...
+                );
+            };
+        }
+    }
+
+    Ret operator()(Args... args) const { return invoke_(target_, std::forward<Args>(args)...); }
+
+private:
+    union Target {
+        void* object;
+        void (*function)();
+    };
+
+    Target target_{ .object = nullptr };
+    Ret (*invoke_)(Target, Args&&...) = [](Target, Args&&...) -> Ret {
+        throw std::bad_function_call{};
+    };
+};
+
+// 存储策略：每个策略给出保存某种签名的可调用对象所用的类型
+
+// 默认，可以保存任意可调用对象，较大的对象会分配堆内存
+struct FunctionStorage {
+    template <typename Signature>
+    using type = std::function<Signature>;
+
+    static constexpr bool owning = true;
+};
+
+// 保存在Capacity字节的内部缓冲区中，不分配堆内存
+template <std::size_t Capacity = kInplaceCapacity>
+struct InplaceStorage {
+    template <typename Signature>
+    using type = InplaceFunction<Signature, Capacity>;
+
+    static constexpr bool owning = true;
+};
+
+// 只保存引用，策略对象由调用者持有
+struct RefStorage {
+    template <typename Signature>
+    using type = FunctionRef<Signature>;
+
+    static constexpr bool owning = false;
+};
+
+// 只接受函数指针和不捕获的lambda
+struct PointerStorage {
+    template <typename Signature>
+    using type = Signature*;
+
+    static constexpr bool owning = true;
+};
+} // namespace strategy
+
+template <typename Signature, typename Storage = strategy::FunctionStorage>
+class StrategyInvoker;
+
+/**
+ * @brief 保存并调用一个策略.
+ *
+ * 除了默认的FunctionStorage，其它存储策略更换策略时都不会分配内存.
+ * @tparam Storage strategy中的存储策略
+ */
+template <typename Ret, typename... Args, typename Storage>
+class StrategyInvoker<Ret(Args...), Storage> {
+public:
+    using strategy_type = typename Storage::template type<Ret(Args...)>;
+    using self_type     = StrategyInvoker;
+
+    // 不拥有策略时只接受左值，避免引用临时对象
+    template <typename F>
+    requires(Storage::owning || std::is_lvalue_reference_v<F>)
+    void SetStrategy(F&& strategy) {
+        strategy_ = std::forward<F>(strategy);
+    }
+
+    // 没有设置策略时抛出std::bad_function_call，与存储策略无关
+    Ret Invoke(Args... args) {
+        if constexpr (std::is_pointer_v<strategy_type>) {
+            if (strategy_ == nullptr) {
+                throw std::bad_function_call{};
+            }
+        }
+        return strategy_(std::forward<Args>(args)...);
+    }
+
+private:
+    strategy_type strategy_{};
+};
+
+namespace strategy {
+// 按输入大小的数量级分桶：0, 1, 2-3, 4-7, ...
+[[nodiscard]] constexpr std::size_t Log2Bucket(std::size_t size) noexcept {
+    return static_cast<std::size_t>(std::bit_width(size));
+}
+
+struct AdaptiveOptions {
+    // 每个候选在每个桶中预热的次数
+    std::size_t warmup = 8;
+    // 选定之后继续探索的概率，0表示选定后不再计时
+    double epsilon = 0.0;
+    // 桶的数量，更大的桶号归入最后一个桶
+    std::size_t bucket_count = 64;
+    // 给候选计时用的时钟，测试中可以替换
+    std::chrono::steady_clock::time_point (*now)() = &std::chrono::steady_clock::now;
+};
+
+struct AdaptiveDecision {
+    std::size_t bucket;
+    std::string_view name;
+    std::chrono::nanoseconds average;
+};
+
+template <typename Signature>
+class AdaptiveStrategy;
+
+/**
+ * @brief 在线计时、自动选出每个桶中最快候选的策略.
+ *
+ * 每次调用先用分桶函数得到桶号；桶中每个候选都预热warmup次之后，平均耗时最短的胜出，
+ * 之后的调用只读取一个原子变量就直接调用胜出者.epsilon大于0时，仍以这个概率随机计时一个候选，
+ * 按指数移动平均更新耗时，出现更快的候选时切换.
+ * 决策表可以用Save/Load持久化，重启后跳过预热.候选需要在第一次调用之前添加完.
+ */
+template <typename Ret, typename... Args>
+class AdaptiveStrategy<Ret(Args...)> {
+public:
+    using function_type = std::function<Ret(Args...)>;
+    using bucket_type   = std::function<std::size_t(Args const&...)>;
+    using self_type     = AdaptiveStrategy;
+
+    explicit AdaptiveStrategy(bucket_type bucket, AdaptiveOptions options = {})
+        : bucket_(std::move(bucket)), options_(options),
+          buckets_(std::make_unique<Bucket[]>(std::max<std::size_t>(options.bucket_count, 1))) {
+        options_.bucket_count = std::max<std::size_t>(options.bucket_count, 1);
+    }
+
+    void Add(std::string name, function_type candidate) {
+        candidates_.push_back({ std::move(name), std::move(candidate) });
+    }
+
+    Ret operator()(Args... args) { return Invoke(std::forward<Args>(args)...); }
+
+    Ret Invoke(Args... args) {
+        auto& bucket = buckets_[std::min(bucket_(args...), options_.bucket_count - 1)];
+        auto winner  = bucket.winner.load(std::memory_order_acquire);
+        if (winner != kUndecided && !Explore()) [[likely]] {
+            return candidates_[winner].function(std::forward<Args>(args)...);
+        }
+        return Timed(bucket, Choose(bucket, winner), std::forward<Args>(args)...);
+    }
+
+    [[nodiscard]] std::optional<std::string_view> Winner(std::size_t bucket) const {
+        auto const winner = buckets_[std::min(bucket, options_.bucket_count - 1)].winner.load(
+            std::memory_order_acquire
+        );
+        if (winner == kUndecided) {
+            return std::nullopt;
+        }
+        return candidates_[winner].name;
+    }
+
+    // 已经选定的桶
+    [[nodiscard]] std::vector<AdaptiveDecision> Decisions() const {
+        auto decisions = std::vector<AdaptiveDecision>{};
+        for (auto index = std::size_t{ 0 }; index < options_.bucket_count; ++index) {
+            auto& bucket      = buckets_[index];
+            auto const winner = bucket.winner.load(std::memory_order_acquire);
+            if (winner == kUndecided) {
+                continue;
+            }
+            auto lock    = std::lock_guard{ bucket.mutex };
+            auto average = std::chrono::nanoseconds{ 0 };
+            if (!bucket.samples.empty()) {
+                average = std::chrono::nanoseconds{
+                    static_cast<std::int64_t>(bucket.samples[winner].average)
+                };
+            }
+            decisions.push_back({ index, candidates_[winner].name, average });
+        }
+        return decisions;
+    }
+
+    // 每行一个桶：桶号 候选名
+    void Save(std::ostream& output) const {
+        for (auto const& decision : Decisions()) {
+            output << decision.bucket << ' ' << decision.name << '\n';
+        }
+    }
+
+    // 不认识的候选名会被忽略，这样候选集合变化之后仍然可以加载旧的决策表
+    // 整个输入解析成功之后才更新决策表，格式错误时决策表保持不变
+    void Load(std::istream& input) {
+        auto decisions = std::vector<std::pair<std::size_t, std::size_t>>{};
+        auto index     = std::size_t{};
+        auto name      = std::string{};
+        while (input >> index) {
+            // 只有桶号没有候选名的行，比如被截断的最后一行
+            if (!(input >> name)) {
+                throw std::runtime_error("Malformed strategy decision table");
+            }
+            if (index >= options_.bucket_count) {
+                continue;
+            }
+            for (auto candidate = std::size_t{ 0 }; candidate < candidates_.size(); ++candidate) {
+                if (candidates_[candidate].name == name) {
+                    decisions.emplace_back(index, candidate);
+                    break;
+                }
+            }
+        }
+        if (!input.eof()) {
+            throw std::runtime_error("Malformed strategy decision table");
+        }
+        for (auto const& [bucket, candidate] : decisions) {
+            buckets_[bucket].winner.store(candidate, std::memory_order_release);
+        }
+    }
+
+private:
+    static constexpr auto kUndecided = std::numeric_limits<std::size_t>::max();
+    // 选定之后的指数移动平均系数
+    static constexpr auto kSmoothing = 0.125;
+
+    struct Candidate {
+        std::string name;
+        function_type function;
+    };
+
+    struct Sample {
+        std::size_t count = 0;
+        double average    = 0;
+    };
+
+    struct Bucket {
+        std::atomic<std::size_t> winner{ kUndecided };
+        mutable std::mutex mutex;
+        std::vector<Sample> samples;
+    };
+
+    static std::minstd_rand& Engine() {
+        thread_local auto engine = std::minstd_rand{ std::random_device{}() };
+        return engine;
+    }
+
+    bool Explore() const {
+        return options_.epsilon > 0 &&
+               std::uniform_real_distribution<double>{ 0, 1 }(Engine()) < options_.epsilon;
+    }
+
+    // 预热时选样本最少的候选，探索时随机选一个
+    std::size_t Choose(Bucket& bucket, std::size_t winner) {
+        if (candidates_.empty()) {
+            throw std::runtime_error("No candidate strategy");
+        }
+        if (winner != kUndecided) {
+            auto const last = candidates_.size() - 1;
+            return std::uniform_int_distribution<std::size_t>{ 0, last }(Engine());
+        }
+        auto lock = std::lock_guard{ bucket.mutex };
+        bucket.samples.resize(candidates_.size());
+        auto const fewest = std::ranges::min_element(bucket.samples, {}, &Sample::count);
+        return static_cast<std::size_t>(fewest - bucket.samples.begin());
+    }
+
+    Ret Timed(Bucket& bucket, std::size_t candidate, Args... args) {
+        auto const start = options_.now();
+        if constexpr (std::is_void_v<Ret>) {
+            candidates_[candidate].function(std::forward<Args>(args)...);
+            Record(bucket, candidate, options_.now() - start);
+        }
+        else {
+            auto result = candidates_[candidate].function(std::forward<Args>(args)...);
+            Record(bucket, candidate, options_.now() - start);
+            return result;
+        }
+    }
+
+    void Record(Bucket& bucket, std::size_t candidate, std::chrono::nanoseconds elapsed) {
+        auto const nanoseconds = static_cast<double>(elapsed.count());
+
+        auto lock = std::lock_guard{ bucket.mutex };
+        bucket.samples.resize(candidates_.size());
+        auto& sample = bucket.samples[candidate];
+        ++sample.count;
+        if (sample.count <= options_.warmup || bucket.winner.load() == kUndecided) {
+            sample.average += (nanoseconds - sample.average) / static_cast<double>(sample.count);
+        }
+        else {
+            sample.average += (nanoseconds - sample.average) * kSmoothing;
+        }
+
+        auto const warm = std::ranges::all_of(bucket.samples, [this](Sample const& sample) {
+            return sample.count >= options_.warmup;
+        });
+        if (warm) {
+            auto const fastest = std::ranges::min_element(bucket.samples, {}, &Sample::average);
+            auto const index   = static_cast<std::size_t>(fastest - bucket.samples.begin());
+            bucket.winner.store(index, std::memory_order_release);
+        }
+    }
+
+    bucket_type bucket_;
+    AdaptiveOptions options_;
+    std::vector<Candidate> candidates_;
+    std::unique_ptr<Bucket[]> buckets_;
+};
+} // namespace strategy
+
+namespace command {
+
+template <typename T>
+class Command {
+public:
+    using self_type = Command;
+
+    virtual ~Command() = default;
+    virtual void Execute() {}
+
+protected:
+    Command() = default;
+};
+
+template <typename>
+class CommandQueue;
+
+// 不需要多态的命令可以不继承Command<T>，只要有可以访问的Execute()
+template <typename SpecificCommand, typename T>
+concept BufferCommand = std::is_base_of_v<Command<T>, SpecificCommand> ||
+                        requires(SpecificCommand& command) { command.Execute(); };
+
+/**
+ * @brief 连续存放命令的缓冲区.
+ *
+ * 命令被移动进一块可以增长的字节区域，一个接一个地就地构造，每条记录前面是一个函数指针头
+ * （执行、搬移、析构），Execute按顺序线性执行，不会切割，也不会为每个命令分配堆内存.
+ * Reset之后保留容量.继承Command<T>的命令有虚析构函数，Reset时要逐个析构；
+ * 只有Execute()、可以平凡复制的命令增长时按字节搬移，全是这种命令时Reset是O(1)的，适合每帧复用.
+ * 命令的对齐不能超过alignof(std::max_align_t)，移动构造不能抛异常.
+ */
+template <typename T>
+class CommandBuffer {
+    friend class CommandQueue<T>;
+
+    struct Header;
+
+public:
+    using self_type = CommandBuffer;
+
+    // 缓冲区中的一条命令
+    class Record {
+    public:
+        Record() = default;
+
+        void Execute() const { header_->ops->execute(Object()); }
+
+    private:
+        friend class CommandBuffer;
+
+        explicit Record(std::byte* record) noexcept
+            : header_(std::launder(reinterpret_cast<Header const*>(record))) {}
+
+        void* Object() const noexcept {
+            return const_cast<std::byte*>(reinterpret_cast<std::byte const*>(header_)) +
+                   kHeaderSize;
+        }
+
+        Header const* header_ = nullptr;
+    };
+
+    class RecordIterator
+        : public iterator::Iterator<RecordIterator, Record, std::forward_iterator_tag, Record> {
+    public:
+        RecordIterator() = default;
+
+    private:
+        friend class CommandBuffer;
+        friend class iterator::IteratorAccess;
+
+        explicit RecordIterator(std::byte* position) noexcept : position_(position) {}
+
+        Record dereference() const { return Record{ position_ }; }
+        void increment() { position_ += Record{ position_ }.header_->size; }
+        bool equal(RecordIterator const& other) const { return position_ == other.position_; }
+
+        std::byte* position_ = nullptr;
+    };
+
+    CommandBuffer() = default;
+
+    CommandBuffer(CommandBuffer const&)            = delete;
+    CommandBuffer& operator=(CommandBuffer const&) = delete;
+
+    CommandBuffer(CommandBuffer&& other) noexcept
+        : data_(std::exchange(other.data_, nullptr)),
+          capacity_(std::exchange(other.capacity_, 0)),
+          used_(std::exchange(other.used_, 0)),
+          count_(std::exchange(other.count_, 0)),
+          trivial_(std::exchange(other.trivial_, true)) {}
+
+    CommandBuffer& operator=(CommandBuffer&& other) noexcept {
+        if (this != &other) {
+            Release();
+            data_     = std::exchange(other.data_, nullptr);
+            capacity_ = std::exchange(other.capacity_, 0);
+            used_     = std::exchange(other.used_, 0);
+            count_    = std::exchange(other.count_, 0);
+            trivial_  = std::exchange(other.trivial_, true);
+        }
+        return *this;
+    }
+
+    ~CommandBuffer() { Release(); }
+
+    template <typename SpecificCommand, typename... Args>
+    requires BufferCommand<SpecificCommand, T>
+    SpecificCommand& Emplace(Args&&... args) {
+        static_assert(alignof(SpecificCommand) <= kAlignment, "command is over-aligned");
+        static_assert(std::is_nothrow_move_constructible_v<SpecificCommand>);
+
+        constexpr auto record_size = RoundUp(kHeaderSize + sizeof(SpecificCommand));
+        Grow(used_ + record_size);
+
+        auto* record  = data_ + used_;
+        auto* command = ::new (static_cast<void*>(record + kHeaderSize))
+            SpecificCommand(std::forward<Args>(args)...);
+        ::new (static_cast<void*>(record)) Header{ &kOps<SpecificCommand>, record_size };
+
+        used_ += record_size;
+        ++count_;
+        trivial_ = trivial_ && std::is_trivially_copyable_v<SpecificCommand>;
+        return *command;
+    }
+
+    template <typename Type>
+    requires BufferCommand<std::decay_t<Type>, T>
+    void Add(Type&& command) {
+        Emplace<std::decay_t<Type>>(std::forward<Type>(command));
+    }
+
+    // 按添加的顺序执行一遍，命令保留在缓冲区中
+    void Execute() {
+        for (auto offset = std::size_t{ 0 }; offset < used_;) {
+            auto const* header = HeaderAt(offset);
+            header->ops->execute(data_ + offset + kHeaderSize);
+            offset += header->size;
+        }
+    }
+
+    // 清空命令，保留容量
+    void Reset() noexcept {
+        if (!trivial_) {
+            for (auto offset = std::size_t{ 0 }; offset < used_;) {
+                auto const* header = HeaderAt(offset);
+                header->ops->destroy(data_ + offset + kHeaderSize);
+                offset += header->size;
+            }
+        }
+        used_    = 0;
+        count_   = 0;
+        trivial_ = true;
+    }
+
+    void Reserve(std::size_t bytes) { Grow(bytes); }
+
+    // 按添加的顺序遍历命令，添加命令会使迭代器失效
+    [[nodiscard]] RecordIterator begin() const noexcept { return RecordIterator{ data_ }; }
+    [[nodiscard]] RecordIterator end() const noexcept { return RecordIterator{ data_ + used_ }; }
+
+    [[nodiscard]] std::size_t size() const noexcept { return count_; }
+    [[nodiscard]] bool empty() const noexcept { return count_ == 0; }
+    [[nodiscard]] std::size_t Bytes() const noexcept { return used_; }
+    [[nodiscard]] std::size_t Capacity() const noexcept { return capacity_; }
+    // 所有命令都可以平凡复制，这时Reset不需要遍历
+    [[nodiscard]] bool Trivial() const noexcept { return trivial_; }
+
+private:
+    struct Ops {
+        void (*execute)(void*);
+        void (*relocate)(void*, void*) noexcept;
+        void (*destroy)(void*) noexcept;
+        std::size_t size;
+    };
+
+    struct Header {
+        Ops const* ops;
+        std::size_t size;
+    };
+
+    static constexpr std::size_t kAlignment = alignof(std::max_align_t);
+
+    static constexpr std::size_t RoundUp(std::size_t size) noexcept {
+        return (size + kAlignment - 1) / kAlignment * kAlignment;
+    }
+
+    static constexpr std::size_t kHeaderSize = RoundUp(sizeof(Header));
+
+    template <typename SpecificCommand>
+    static constexpr Ops kOps{
+        [](void* self) {
+            auto& command = *static_cast<SpecificCommand*>(self);
+            // 可以访问时直接调用，避免虚调用；Execute是私有的时候只能通过基类调用
+            if constexpr (requires { command.SpecificCommand::Execute(); }) {
+                command.SpecificCommand::Execute();
+            }
+            else {
+                static_cast<Command<T>&>(command).Execute();
+            }
+        },
+        [](void* from, void* to) noexcept {
+            auto* command = static_cast<SpecificCommand*>(from);
+            ::new (to) SpecificCommand(std::move(*command));
+            std::destroy_at(command);
+        },
+        [](void* self) noexcept { std::destroy_at(static_cast<SpecificCommand*>(self)); },
+        sizeof(SpecificCommand),
+    };
+
+    Header const* HeaderAt(std::size_t offset) const noexcept {
+        return std::launder(reinterpret_cast<Header const*>(data_ + offset));
+    }
+
+    void Grow(std::size_t required) {
+        if (required <= capacity_) {
+            return;
+        }
+        auto const capacity = std::max({ required, capacity_ * 2, std::size_t{ 256 } });
+        auto* data          = static_cast<std::byte*>(
+            ::operator new(capacity, std::align_val_t{ kAlignment })
+        );
+        if (trivial_) {
+            if (used_ != 0) {
+                std::memcpy(data, data_, used_);
+            }
+        }
+        else {
+            for (auto offset = std::size_t{ 0 }; offset < used_;) {
+                auto const header = *HeaderAt(offset);
+                ::new (static_cast<void*>(data + offset)) Header{ header };
+                header.ops->relocate(data_ + offset + kHeaderSize, data + offset + kHeaderSize);
+                offset += header.size;
+            }
+        }
+        Deallocate();
+        data_     = data;
+        capacity_ = capacity;
+    }
+
+    // 把类型擦除的命令搬进来，源对象会被析构；不知道命令是否平凡，按需要析构处理
+    void Adopt(Ops const* ops, void* command) {
+        auto const record_size = RoundUp(kHeaderSize + ops->size);
+        Grow(used_ + record_size);
+
+        auto* record = data_ + used_;
+        ops->relocate(command, record + kHeaderSize);
+        ::new (static_cast<void*>(record)) Header{ ops, record_size };
+
+        used_ += record_size;
+        ++count_;
+        trivial_ = false;
+    }
+
+    // 命令已经被搬走，只清空记录，不再析构
+    void Forget() noexcept {
+        used_    = 0;
+        count_   = 0;
+        trivial_ = true;
+    }
+
+    void Deallocate() noexcept {
+        if (data_ != nullptr) {
+            ::operator delete(data_, std::align_val_t{ kAlignment });
+        }
+    }
+
+    void Release() noexcept {
+        Reset();
+        Deallocate();
+        data_     = nullptr;
+        capacity_ = 0;
+    }
+
+    std::byte* data_      = nullptr;
+    std::size_t capacity_ = 0;
+    std::size_t used_     = 0;
+    std::size_t count_    = 0;
+    bool trivial_         = true;
+};
+
+/**
+ * @brief 有界的无锁多生产者单消费者命令队列.
+ *
+ * 环形数组的每个槽位带一个序号（Vyukov的有界队列），生产者用CAS占用槽位，消费者根据序号判断
+ * 槽位是否已经写好. 命令沿用CommandBuffer的类型擦除，直接构造在槽位中，不分配堆内存，
+ * 每个槽位以及队首、队尾各占一个缓存行.
+ * 生产者可以通过Producer在本地攒一批命令，一次CAS占用连续的槽位，减少对队尾的争用.
+ * 同一时刻只能有一个线程调用Drain和DrainInto.
+ */
+template <typename T>
+class CommandQueue {
+    using Buffer = CommandBuffer<T>;
+    using Ops    = typename Buffer::Ops;
+
+public:
+    using self_type = CommandQueue;
+
+    // 槽位中命令对象的最大尺寸
+    static constexpr std::size_t kPayloadSize = 48;
+    static constexpr auto kAll                = std::numeric_limits<std::size_t>::max();
+
+    class Producer;
+
+    // 容量向上取整到2的幂
+    explicit CommandQueue(std::size_t capacity)
+        : capacity_(std::bit_ceil(std::max<std::size_t>(capacity, 2))),
+          mask_(capacity_ - 1),
+          cells_(std::make_unique<Cell[]>(capacity_)) {
+        for (auto index = std::size_t{ 0 }; index < capacity_; ++index) {
+            cells_[index].sequence.store(index, std::memory_order_relaxed);
+        }
+    }
+
+    CommandQueue(CommandQueue const&)            = delete;
+    CommandQueue& operator=(CommandQueue const&) = delete;
+
+    // 析构时没有执行的命令直接析构
+    ~CommandQueue() {
+        for (auto position = head_.load(std::memory_order_relaxed);; ++position) {
+            auto& cell = cells_[position & mask_];
+            if (cell.sequence.load(std::memory_order_acquire) != position + 1) {
+                break;
+            }
+            cell.ops->destroy(cell.storage);
+        }
+    }
+
+    // 队列满时返回false，命令不会被移动
+    template <typename Type>
+    requires std::is_base_of_v<Command<T>, std::decay_t<Type>>
+    [[nodiscard]] bool TryPush(Type&& command) {
+        using SpecificCommand = std::decay_t<Type>;
+        CheckCommand<SpecificCommand>();
+
+        if constexpr (!std::is_nothrow_constructible_v<SpecificCommand, Type&&>) {
+            // 先在队列外构造，避免占用槽位之后构造失败
+            return TryPush(SpecificCommand(std::forward<Type>(command)));
+        }
+        else {
+            auto position = std::size_t{ 0 };
+            if (!Reserve(position, 1)) {
+                return false;
+            }
+            auto& cell = cells_[position & mask_];
+            ::new (static_cast<void*>(cell.storage)) SpecificCommand(std::forward<Type>(command));
+            cell.ops = &Buffer::template kOps<SpecificCommand>;
+            cell.sequence.store(position + 1, std::memory_order_release);
+            return true;
+        }
+    }
+
+    // 队列满时让出时间片，直到有空位
+    template <typename Type>
+    requires std::is_base_of_v<Command<T>, std::decay_t<Type>>
+    void Push(Type&& command) {
+        using SpecificCommand = std::decay_t<Type>;
+        if constexpr (!std::is_nothrow_constructible_v<SpecificCommand, Type&&>) {
+            Push(SpecificCommand(std::forward<Type>(command)));
+        }
+        else {
+            while (!TryPush(std::forward<Type>(command))) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    /**
+     * @brief 一次占用连续的槽位，把缓冲区中的所有命令搬进队列.
+     *
+     * 要么全部入队并清空缓冲区，要么队列空间不足返回false、缓冲区保持不变.
+     * 命令数超过容量或者有命令超过kPayloadSize时抛出std::runtime_error.
+     */
+    [[nodiscard]] bool TryPushBatch(Buffer& commands) {
+        auto const count = commands.size();
+        if (count == 0) {
+            return true;
+        }
+        if (count > capacity_) {
+            throw std::runtime_error("command batch exceeds the queue capacity");
+        }
+        for (auto offset = std::size_t{ 0 }; offset < commands.used_;) {
+            auto const* header = commands.HeaderAt(offset);
+            if (header->ops->size > kPayloadSize) {
+                throw std::runtime_error("command is too large for the queue");
+            }
+            offset += header->size;
+        }
+
+        auto position = std::size_t{ 0 };
+        if (!Reserve(position, count)) {
+            return false;
+        }
+        for (auto offset = std::size_t{ 0 }; offset < commands.used_; ++position) {
+            auto const* header = commands.HeaderAt(offset);
+            auto& cell         = cells_[position & mask_];
+            header->ops->relocate(commands.data_ + offset + Buffer::kHeaderSize, cell.storage);
+            cell.ops = header->ops;
+            cell.sequence.store(position + 1, std::memory_order_release);
+            offset += header->size;
+        }
+        commands.Forget();
+        return true;
+    }
+
+    // 按入队的顺序执行最多max个命令，返回执行的个数
+    std::size_t Drain(std::size_t max = kAll) {
+        auto count = std::size_t{ 0 };
+        for (; count < max; ++count) {
+            auto const position = head_.load(std::memory_order_relaxed);
+            auto& cell          = cells_[position & mask_];
+            if (cell.sequence.load(std::memory_order_acquire) != position + 1) {
+                break;
+            }
+            try {
+                cell.ops->execute(cell.storage);
+            }
+            catch (...) {
+                Release(cell, position);
+                throw;
+            }
+            Release(cell, position);
+        }
+        return count;
+    }
+
+    // 把最多max个命令按顺序搬进缓冲区，之后可以交给Invoker或者ParallelInvoker执行
+    std::size_t DrainInto(Buffer& buffer, std::size_t max = kAll) {
+        auto count = std::size_t{ 0 };
+        for (; count < max; ++count) {
+            auto const position = head_.load(std::memory_order_relaxed);
+            auto& cell          = cells_[position & mask_];
+            if (cell.sequence.load(std::memory_order_acquire) != position + 1) {
+                break;
+            }
+            buffer.Adopt(cell.ops, cell.storage);
+            Free(cell, position);
+        }
+        return count;
+    }
+
+    // 其它线程同时读写时只是一个近似值
+    [[nodiscard]] std::size_t size() const noexcept {
+        auto const head = head_.load(std::memory_order_relaxed);
+        auto const tail = tail_.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    [[nodiscard]] bool empty() const noexcept { return size() == 0; }
+    [[nodiscard]] std::size_t Capacity() const noexcept { return capacity_; }
+
+private:
+    static constexpr std::size_t kCacheLine = 64;
+
+    struct alignas(kCacheLine) Cell {
+        std::atomic<std::size_t> sequence;
+        Ops const* ops;
+        alignas(std::max_align_t) std::byte storage[kPayloadSize];
+    };
+
+    template <typename SpecificCommand>
+    static constexpr void CheckCommand() {
+        static_assert(sizeof(SpecificCommand) <= kPayloadSize, "command is too large");
+        static_assert(alignof(SpecificCommand) <= alignof(std::max_align_t));
+        static_assert(std::is_nothrow_move_constructible_v<SpecificCommand>);
+    }
+
+    /**
+     * @brief 占用从position开始的count个槽位.
+     *
+     * 消费者按顺序释放槽位，最后一个槽位空闲时前面的也一定空闲，所以只需要检查最后一个.
+     */
+    bool Reserve(std::size_t& position, std::size_t count) {
+        position = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            auto const last     = position + count - 1;
+            auto const sequence = cells_[last & mask_].sequence.load(std::memory_order_acquire);
+            auto const difference =
+                static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(last);
+            if (difference == 0) {
+                if (tail_.compare_exchange_weak(
+                        position, position + count, std::memory_order_relaxed
+                    )) {
+                    return true;
+                }
+            }
+            else if (difference < 0) {
+                // 上一圈的命令还没有被消费，队列已满
+                return false;
+            }
+            else {
+                position = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void Release(Cell& cell, std::size_t position) noexcept {
+        cell.ops->destroy(cell.storage);
+        Free(cell, position);
+    }
+
+    // 槽位留给下一圈的生产者
+    void Free(Cell& cell, std::size_t position) noexcept {
+        cell.sequence.store(position + capacity_, std::memory_order_release);
+        head_.store(position + 1, std::memory_order_relaxed);
+    }
+
+    std::size_t const capacity_;
+    std::size_t const mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(kCacheLine) std::atomic<std::size_t> tail_{ 0 };
+    alignas(kCacheLine) std::atomic<std::size_t> head_{ 0 };
+};
+
+/**
+ * @brief 在生产者线程本地攒命令，满一批后一次性入队.
+ *
+ * 一个Producer只能由一个线程使用，析构时会把剩下的命令全部入队.
+ */
+template <typename T>
+class CommandQueue<T>::Producer {
+public:
+    using self_type = Producer;
+
+    Producer(CommandQueue& queue, std::size_t batch)
+        : queue_(queue), batch_(std::clamp<std::size_t>(batch, 1, queue.Capacity())) {}
+
+    Producer(Producer const&)            = delete;
+    Producer& operator=(Producer const&) = delete;
+
+    ~Producer() { Flush(); }
+
+    template <typename Type>
+    requires std::is_base_of_v<Command<T>, std::decay_t<Type>>
+    void Add(Type&& command) {
+        CheckCommand<std::decay_t<Type>>();
+        pending_.Add(std::forward<Type>(command));
+        if (pending_.size() >= batch_) {
+            Flush();
+        }
+    }
+
+    // 队列空间不足时返回false，命令留在本地
+    [[nodiscard]] bool TryFlush() { return queue_.TryPushBatch(pending_); }
+
+    void Flush() {
+        while (!TryFlush()) {
+            std::this_thread::yield();
+        }
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept { return pending_.size(); }
+
+private:
+    CommandQueue& queue_;
+    std::size_t batch_;
+    Buffer pending_;
+};
+
+// 资源的标识，通常是资源的地址
+using ResourceId = std::uintptr_t;
+
+template <typename Resource>
+[[nodiscard]] ResourceId ResourceOf(Resource const& resource) noexcept {
+    return reinterpret_cast<ResourceId>(std::addressof(resource));
+}
+
+// 命令读写的资源，读写同一资源的命令之间保持添加的顺序
+struct Access {
+    std::vector<ResourceId> reads;
+    std::vector<ResourceId> writes;
+};
+
+template <typename>
+class Invoker;
+
+template <typename>
+class ParallelInvoker;
+
+template <typename T>
+class CommandList {
+    friend class Invoker<T>;
+    friend class ParallelInvoker<T>;
+
+public:
+    using self_type = CommandList;
+
+    virtual ~CommandList() = default;
+
+    // 命令被移动进列表，保留实际的类型
+    template <typename Type>
+    requires std::is_base_of_v<Command<T>, std::decay_t<Type>>
+    void Add(Type&& command) {
+        Add(std::forward<Type>(command), Access{});
+    }
+
+    // 没有标注资源的命令与其它命令都不冲突
+    // 先放入资源标注，命令构造失败时撤销，保证两者按下标一一对应
+    template <typename Type>
+    requires std::is_base_of_v<Command<T>, std::decay_t<Type>>
+    void Add(Type&& command, Access access) {
+        access_.push_back(std::move(access));
+        try {
+            commands_.Add(std::forward<Type>(command));
+        }
+        catch (...) {
+            access_.pop_back();
+            throw;
+        }
+    }
+
+    void Clear() noexcept {
+        commands_.Reset();
+        access_.clear();
+    }
+
+protected:
+    CommandList() = default;
+
+private:
+    CommandBuffer<T> commands_;
+    std::vector<Access> access_;
+};
+
+template <typename T>
+class Invoker {
+public:
+    using self_type = Invoker;
+
+    virtual ~Invoker() = default;
+
+    template <typename List>
+    requires std::is_base_of_v<CommandList<T>, std::decay_t<List>>
+    void Invoke(List&& list) {
+        static_cast<CommandList<T>&>(list).commands_.Execute();
+    }
+
+    void Invoke(CommandBuffer<T>& buffer) { buffer.Execute(); }
+
+    // 在消费者线程上执行队列中已有的命令
+    void Invoke(CommandQueue<T>& queue) { queue.Drain(); }
+
+protected:
+    Invoker() = default;
+};
+
+// 可以撤销的命令，Undo恢复Execute之前的状态
+template <typename T>
+class ReversibleCommand : public Command<T> {
+public:
+    using self_type = ReversibleCommand;
+
+    virtual void Undo() {}
+
+protected:
+    ReversibleCommand() = default;
+};
+
+/**
+ * @brief 撤销重做的历史记录.
+ *
+ * 命令对象本身就是增量（例如修改前后的值），按顺序构造在固定大小的环形字节区域中，
+ * 空间不够时丢弃最早的记录，所以内存占用不会超过预算.
+ * 新命令与上一条同类型的命令可以合并时（命令提供bool Merge(Command const& next)并返回true），
+ * 只保留合并后的一条，例如连续修改同一个属性. Undo(n)和Redo(n)一次移动n步.
+ * 执行新命令会丢弃可以重做的记录.
+ */
+template <typename T>
+class History {
+public:
+    using self_type = History;
+
+    explicit History(std::size_t budget)
+        : capacity_(RoundUp(budget)),
+          data_(static_cast<std::byte*>(
+              ::operator new(std::max<std::size_t>(capacity_, 1), std::align_val_t{ kAlignment })
+          )) {}
+
+    History(History const&)            = delete;
+    History& operator=(History const&) = delete;
+
+    ~History() {
+        Clear();
+        ::operator delete(data_, std::align_val_t{ kAlignment });
+    }
+
+    // 执行并记录命令，命令超过预算时抛出std::runtime_error
+    template <typename Type>
+    requires std::is_base_of_v<ReversibleCommand<T>, std::decay_t<Type>>
+    void Execute(Type&& command) {
+        using SpecificCommand = std::decay_t<Type>;
+        static_assert(alignof(SpecificCommand) <= kAlignment, "command is over-aligned");
+        static_assert(std::is_nothrow_move_constructible_v<SpecificCommand>);
+
+        constexpr auto size = RoundUp(sizeof(SpecificCommand));
+        if (size > capacity_) {
+            throw std::runtime_error("command is larger than the history budget");
+        }
+
+        auto local = SpecificCommand(std::forward<Type>(command));
+        kOps<SpecificCommand>.execute(&local);
+        DiscardRedo();
+        if constexpr (requires(SpecificCommand & previous) {
+                          { previous.Merge(std::as_const(local)) } -> std::convertible_to<bool>;
+                      }) {
+            if (!entries_.empty() && entries_.back().ops == &kOps<SpecificCommand>) {
+                auto& previous = *static_cast<SpecificCommand*>(Object(entries_.back()));
+                if (previous.Merge(std::as_const(local))) {
+                    return;
+                }
+            }
+        }
+
+        auto offset = Allocate(size);
+        while (offset == kNone) {
+            EvictOldest();
+            offset = Allocate(size);
+        }
+        auto* stored = ::new (static_cast<void*>(data_ + offset)) SpecificCommand(std::move(local));
+        try {
+            entries_.push_back({ &kOps<SpecificCommand>, offset, size });
+        }
+        catch (...) {
+            // 命令已经执行，只是没有记录下来
+            std::destroy_at(stored);
+            throw;
+        }
+        used_ += size;
+        ++cursor_;
+    }
+
+    // 撤销最近的n条命令，返回实际撤销的条数
+    std::size_t Undo(std::size_t steps = 1) {
+        auto count = std::size_t{ 0 };
+        for (; count < steps && cursor_ != 0; ++count) {
+            auto const& entry = entries_[cursor_ - 1];
+            entry.ops->undo(Object(entry));
+            --cursor_;
+        }
+        return count;
+    }
+
+    // 重做最近撤销的n条命令，返回实际重做的条数
+    std::size_t Redo(std::size_t steps = 1) {
+        auto count = std::size_t{ 0 };
+        for (; count < steps && cursor_ != entries_.size(); ++count) {
+            auto const& entry = entries_[cursor_];
+            entry.ops->execute(Object(entry));
+            ++cursor_;
+        }
+        return count;
+    }
+
+    void Clear() noexcept {
+        while (!entries_.empty()) {
+            DestroyBack();
+        }
+        cursor_ = 0;
+    }
+
+    [[nodiscard]] std::size_t UndoCount() const noexcept { return cursor_; }
+    [[nodiscard]] std::size_t RedoCount() const noexcept { return entries_.size() - cursor_; }
+    [[nodiscard]] std::size_t Bytes() const noexcept { return used_; }
+    [[nodiscard]] std::size_t Budget() const noexcept { return capacity_; }
+
+private:
+    struct Ops {
+        void (*execute)(void*);
+        void (*undo)(void*);
+        void (*destroy)(void*) noexcept;
+    };
+
+    struct Entry {
+        Ops const* ops;
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    static constexpr std::size_t kAlignment = alignof(std::max_align_t);
+    static constexpr auto kNone             = std::numeric_limits<std::size_t>::max();
+
+    static constexpr std::size_t RoundUp(std::size_t size) noexcept {
+        return (size + kAlignment - 1) / kAlignment * kAlignment;
+    }
+
+    template <typename SpecificCommand>
+    static constexpr Ops kOps{
+        [](void* self) {
+            auto& command = *static_cast<SpecificCommand*>(self);
+            if constexpr (requires { command.SpecificCommand::Execute(); }) {
+                command.SpecificCommand::Execute();
+            }
+            else {
+                static_cast<Command<T>&>(command).Execute();
+            }
+        },
+        [](void* self) {
+            auto& command = *static_cast<SpecificCommand*>(self);
+            if constexpr (requires { command.SpecificCommand::Undo(); }) {
+                command.SpecificCommand::Undo();
+            }
+            else {
+                static_cast<ReversibleCommand<T>&>(command).Undo();
+            }
+        },
+        [](void* self) noexcept { std::destroy_at(static_cast<SpecificCommand*>(self)); },
+    };
+
+    void* Object(Entry const& entry) const noexcept { return data_ + entry.offset; }
+
+    /**
+     * @brief 在最新记录之后找size字节的连续空间，找不到返回kNone.
+     *
+     * 记录按时间顺序首尾相接，没有回绕时可以用尾部到末尾或者开头到最早记录之间的空间，
+     * 回绕之后只能用最新记录到最早记录之间的空间.
+     */
+    std::size_t Allocate(std::size_t size) const noexcept {
+        if (entries_.empty()) {
+            return 0;
+        }
+        auto const head = entries_.front().offset;
+        auto const tail = entries_.back().offset + entries_.back().size;
+        if (tail > head) {
+            if (capacity_ - tail >= size) {
+                return tail;
+            }
+            return head >= size ? 0 : kNone;
+        }
+        return head - tail >= size ? tail : kNone;
+    }
+
+    void EvictOldest() noexcept {
+        auto const& entry = entries_.front();
+        entry.ops->destroy(Object(entry));
+        used_ -= entry.size;
+        entries_.pop_front();
+        --cursor_;
+    }
+
+    void DiscardRedo() noexcept {
+        while (entries_.size() > cursor_) {
+            DestroyBack();
+        }
+    }
+
+    void DestroyBack() noexcept {
+        auto const& entry = entries_.back();
+        entry.ops->destroy(Object(entry));
+        used_ -= entry.size;
+        entries_.pop_back();
+    }
+
+    std::size_t const capacity_;
+    std::byte* data_;
+    std::deque<Entry> entries_;
+    std::size_t cursor_ = 0;
+    std::size_t used_   = 0;
+};
+
+/**
+ * @brief 延迟启动的协程，co_await时才开始执行，结束后恢复等待它的协程.
+ *
+ * 协程中抛出的异常在co_await处重新抛出.
+ */
+class Task {
+public:
+    struct promise_type {
+        Task get_return_object() noexcept {
+            return Task{ std::coroutine_handle<promise_type>::from_promise(*this) };
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        auto final_suspend() noexcept {
+            struct Final {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<>
+                await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                    return handle.promise().continuation;
+                }
+                void await_resume() noexcept {}
+            };
+            return Final{};
+        }
+
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { error = std::current_exception(); }
+
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+        std::exception_ptr error;
+    };
+
+    using self_type = Task;
+
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            Destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task() { Destroy(); }
+
+    auto operator co_await() noexcept {
+        struct Awaiter {
+            bool await_ready() const noexcept { return !handle || handle.done(); }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+
+            void await_resume() const {
+                if (handle && handle.promise().error) {
+                    std::rethrow_exception(handle.promise().error);
+                }
+            }
+
+            std::coroutine_handle<promise_type> handle;
+        };
+        return Awaiter{ handle_ };
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) noexcept : handle_(handle) {}
+
+    void Destroy() noexcept {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
 
-protected:
-    Bridge() = default;
-    T object_;
+    std::coroutine_handle<promise_type> handle_;
 };
 
-// 类型擦除
-template <typename T>
-class SpecificBridge : public Bridge<T> {
-public:
-    using value_type = T;
-    using self_type  = SpecificBridge<value_type>;
+namespace detail {
+// 立即开始、结束后自行销毁的协程
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
 };
-} // namespace bridge
-
-namespace composite {
-template <typename T>
-class Component {
-public:
-    using value_type = T;
-    using self_type  = Component;
 
-    virtual ~Component()                                      = default;
-    virtual void Add(std::shared_ptr<Component> component)    = 0;
-    virtual void Remove(std::shared_ptr<Component> component) = 0;
+struct SyncWaitState {
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool done = false;
+    std::exception_ptr error;
 };
 
-template <typename T>
-class Leaf : public Component<T> {
-public:
-    virtual void Add(std::shared_ptr<Component<T>> component) override {
-        throw std::runtime_error("Cannot add to a leaf");
+inline Detached SyncWaitFor(Task& task, SyncWaitState& state) {
+    auto error = std::exception_ptr{};
+    try {
+        co_await task;
     }
-    virtual void Remove(std::shared_ptr<Component<T>> component) override {
-        throw std::runtime_error("Cannot add to a leaf");
-    };
-};
+    catch (...) {
+        error = std::current_exception();
+    }
+    // 在锁内通知，解锁之后等待的线程才能销毁state
+    auto lock   = std::lock_guard{ state.mutex };
+    state.error = error;
+    state.done  = true;
+    state.condition.notify_all();
+}
 
-template <typename T>
-class Composite : public Component<T> {
+/**
+ * @brief 定时器线程，到期或者取消时把协程交给线程池恢复.
+ *
+ * 所有等待中的协程共用这一个线程，等待本身不占用线程池的线程.
+ */
+class Timer {
 public:
-    virtual void Add(std::shared_ptr<Component<T>> component) override {
-        children_.push_back(component);
+    using clock = std::chrono::steady_clock;
+
+    explicit Timer(ThreadPool& pool)
+        : pool_(pool), thread_([this](std::stop_token stop) { Run(stop); }) {}
+
+    Timer(Timer const&)            = delete;
+    Timer& operator=(Timer const&) = delete;
+
+    // cancelled在恢复之前写入，表示是否因为取消而提前恢复
+    void Schedule(
+        clock::time_point deadline,
+        std::stop_token stop,
+        std::coroutine_handle<> handle,
+        bool* cancelled
+    ) {
+        auto lock = std::lock_guard{ mutex_ };
+        entries_.push_back({ deadline, std::move(stop), handle, cancelled });
+        std::ranges::push_heap(entries_, std::greater{}, &Entry::deadline);
+        woken_ = true;
+        condition_.notify_one();
     }
 
-    virtual void Remove(std::shared_ptr<Component<T>> component) override {
-        if (auto it = std::find(children_.begin(), children_.end(), component);
-            it != children_.end()) {
-            children_.erase(it);
-        }
+    // 让定时器线程重新检查取消的协程
+    void Wake() {
+        auto lock = std::lock_guard{ mutex_ };
+        woken_    = true;
+        condition_.notify_one();
     }
 
 private:
-    std::vector<std::shared_ptr<Component<T>>> children_;
-};
-} // namespace composite
+    struct Entry {
+        clock::time_point deadline;
+        std::stop_token stop;
+        std::coroutine_handle<> handle;
+        bool* cancelled;
+    };
 
-namespace proxy {
-template <typename T>
-class Proxy : public T {
-public:
-    virtual ~Proxy() = default;
+    void Run(std::stop_token stop) {
+        auto due  = std::vector<Entry>{};
+        auto lock = std::unique_lock{ mutex_ };
+        while (!stop.stop_requested()) {
+            if (entries_.empty()) {
+                condition_.wait(lock, stop, [this]() { return woken_; });
+            }
+            else {
+                // 等待时会解锁，不能引用entries_中的元素
+                auto const deadline = entries_.front().deadline;
+                condition_.wait_until(lock, stop, deadline, [this]() { return woken_; });
+            }
+            woken_ = false;
 
-    T* GetObject() {
-        if (!proxied_object_) {
-            proxied_object_ = object_create_method_();
+            auto const now     = clock::now();
+            auto const removed = std::ranges::remove_if(entries_, [&](Entry const& entry) {
+                if (entry.deadline <= now || entry.stop.stop_requested()) {
+                    *entry.cancelled = entry.deadline > now;
+                    due.push_back(entry);
+                    return true;
+                }
+                return false;
+            });
+            entries_.erase(removed.begin(), removed.end());
+            std::ranges::make_heap(entries_, std::greater{}, &Entry::deadline);
+
+            lock.unlock();
+            for (auto const& entry : due) {
+                pool_.Submit([handle = entry.handle]() { handle.resume(); });
+            }
+            due.clear();
+            lock.lock();
         }
-        return proxied_object_.get();
     }
-    Proxy(std::function<std::unique_ptr<T>()> object_create_method)
-        : object_create_method_(object_create_method), proxied_object_(nullptr) {}
 
-private:
-    std::function<std::unique_ptr<T>()> object_create_method_;
-    mutable std::unique_ptr<T> proxied_object_;
+    ThreadPool& pool_;
+    std::mutex mutex_;
+    std::condition_variable_any condition_;
+    std::vector<Entry> entries_;
+    bool woken_ = false;
+    std::jthread thread_;
 };
-} // namespace proxy
+} // namespace detail
 
-namespace iterator {
+// 在当前线程上等待协程结束，重新抛出其中的异常
+inline void SyncWait(Task task) {
+    auto state = detail::SyncWaitState{};
+    detail::SyncWaitFor(task, state);
+    auto lock = std::unique_lock{ state.mutex };
+    state.condition.wait(lock, [&state]() { return state.done; });
+    if (state.error) {
+        std::rethrow_exception(state.error);
+    }
+}
 
-// facade pattern realized iterator, referenced "C++ Templates 2nd"
-template <typename Derived, typename Value, typename Category, typename Distance = std::ptrdiff_t>
-class Iterator {
+// 异步命令执行时可以使用的服务
+class AsyncContext {
 public:
-    using value_type        = typename std::remove_const_t<Value>;
-    using self_type         = Iterator;
-    using reference         = Derived&;
-    using pointer           = Derived*;
-    using difference_type   = Distance;
-    using iterator_category = Category;
+    class DelayAwaiter {
+    public:
+        DelayAwaiter(detail::Timer& timer, std::chrono::nanoseconds duration, std::stop_token stop)
+            : timer_(timer), duration_(duration), stop_(std::move(stop)) {}
 
-    virtual ~Iterator() = default;
+        [[nodiscard]] bool await_ready() const noexcept {
+            return duration_.count() <= 0 || stop_.stop_requested();
+        }
 
-    virtual bool is_same(self_type const& other) const { return ptr_ == other.ptr_; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            timer_.Schedule(
+                detail::Timer::clock::now() + duration_, stop_, handle, &cancelled_
+            );
+        }
 
-    // input
-    virtual reference operator*() const = 0;
-    virtual pointer operator->() const  = 0;
-    virtual Derived& operator++()       = 0;
+        // 被取消时返回false
+        bool await_resume() const noexcept { return !cancelled_ && !stop_.stop_requested(); }
 
-    // both
-    virtual Derived& operator--() {};
+    private:
+        detail::Timer& timer_;
+        std::chrono::nanoseconds duration_;
+        std::stop_token stop_;
+        bool cancelled_ = false;
+    };
 
-    // random
-    virtual reference operator[](difference_type n) const {}
-    Derived& operator+=(difference_type n) {}
+    AsyncContext(detail::Timer& timer, std::stop_token stop) noexcept
+        : timer_(&timer), stop_(std::move(stop)) {}
 
-protected:
-    Iterator() = default;
+    [[nodiscard]] std::stop_token StopToken() const noexcept { return stop_; }
+    [[nodiscard]] bool StopRequested() const noexcept { return stop_.stop_requested(); }
+
+    // 等待一段时间而不占用线程，取消时提前恢复
+    [[nodiscard]] DelayAwaiter Delay(std::chrono::nanoseconds duration) const {
+        return DelayAwaiter{ *timer_, duration, stop_ };
+    }
 
 private:
-    pointer ptr_;
+    detail::Timer* timer_;
+    std::stop_token stop_;
 };
-} // namespace iterator
 
-namespace visitor {
+// 可以在等待时让出线程的命令
 template <typename T>
-class Element {
+class AsyncCommand {
 public:
-    using value_type = T;
-    using self_type  = Element;
+    using self_type = AsyncCommand;
 
-    virtual ~Element() = default;
+    virtual ~AsyncCommand() = default;
+    virtual Task ExecuteAsync(AsyncContext) { co_return; }
 
 protected:
-    Element() = default;
-};
-
-template <typename T>
-class Visitor {
-    using value_type = T;
-    using self_type  = Visitor;
+    AsyncCommand() = default;
 };
-} // namespace visitor
 
 template <typename>
-class StrategyInvoker;
+class AsyncInvoker;
+
+template <typename T>
+class AsyncCommandList {
+    friend class AsyncInvoker<T>;
 
-template <typename Ret, typename... Args>
-class StrategyInvoker<Ret(Args...)> {
 public:
-    void SetStrategy(std::function<Ret(Args...)> strategy) { strategy_ = strategy; }
+    using self_type = AsyncCommandList;
+
+    virtual ~AsyncCommandList() = default;
 
-    Ret Invoke(Args&&... args) { strategy_(std::forward<Args>(args)...); }
+    template <typename Type>
+    requires std::is_base_of_v<AsyncCommand<T>, std::decay_t<Type>>
+    void Add(Type&& command) {
+        commands_.push_back(std::make_unique<std::decay_t<Type>>(std::forward<Type>(command)));
+    }
+
+    void Clear() noexcept { commands_.clear(); }
+
+    [[nodiscard]] std::size_t size() const noexcept { return commands_.size(); }
+
+protected:
+    AsyncCommandList() = default;
 
 private:
-    std::function<Ret(Args...)> strategy_;
+    std::vector<std::unique_ptr<AsyncCommand<T>>> commands_;
 };
 
-namespace command {
-
+/**
+ * @brief 在线程池上执行协程命令.
+ *
+ * Invoke返回的Task在列表中的命令全部结束时完成，最多同时执行concurrency个命令.
+ * 命令等待定时器时不占用线程. 请求停止之后还没有开始的命令不再执行，
+ * 正在等待的Delay提前恢复. 命令抛出的第一个异常在co_await Invoke处重新抛出.
+ * 析构之前所有Invoke都必须已经结束，执行期间列表不能修改.
+ */
 template <typename T>
-class Command {
+class AsyncInvoker {
 public:
-    using self_type = Command;
+    using self_type = AsyncInvoker;
 
-    virtual ~Command() = default;
-    virtual void Execute() {}
+    AsyncInvoker(ThreadPool& pool, std::size_t concurrency)
+        : pool_(pool), concurrency_(std::max<std::size_t>(concurrency, 1)), timer_(pool) {}
 
-protected:
-    Command() = default;
-};
+    virtual ~AsyncInvoker() = default;
 
-template <typename>
-class Invoker;
+    template <typename List>
+    requires std::is_base_of_v<AsyncCommandList<T>, std::decay_t<List>>
+    Task Invoke(List& list, std::stop_token stop = {}) {
+        auto& commands = static_cast<AsyncCommandList<T>&>(list).commands_;
+        auto wake      = std::stop_callback{ stop, [this]() { timer_.Wake(); } };
+        auto batch     = Batch{ *this, commands, stop };
+        co_await batch;
+        if (batch.error) {
+            std::rethrow_exception(batch.error);
+        }
+    }
 
-template <typename T>
-class CommandList {
-    friend class Invoker<T>;
+private:
+    using Commands = std::vector<std::unique_ptr<AsyncCommand<T>>>;
 
-public:
-    using self_type = CommandList;
+    // 每条通道依次领取下一个命令，通道数就是并发上限
+    struct Batch {
+        Batch(AsyncInvoker& invoker, Commands& commands, std::stop_token stop)
+            : invoker(invoker), commands(commands), stop(std::move(stop)) {}
 
-    virtual ~CommandList() = default;
+        bool await_ready() const noexcept { return commands.empty(); }
 
-    template <typename Type>
-    requires std::is_base_of_v<Command<T>, std::decay_t<Type>>
-    void Add(Type&& command) {
-        commands_.push_back(command);
+        // 自己也算一个引用，提交完所有通道之前不会被恢复
+        bool await_suspend(std::coroutine_handle<> handle) {
+            continuation = handle;
+            auto const lanes = std::min(invoker.concurrency_, commands.size());
+            active.store(lanes + 1, std::memory_order_relaxed);
+            for (auto lane = std::size_t{ 0 }; lane < lanes; ++lane) {
+                invoker.pool_.Submit([this]() { Drive(*this); });
+            }
+            return active.fetch_sub(1, std::memory_order_acq_rel) != 1;
+        }
+
+        void await_resume() const noexcept {}
+
+        AsyncInvoker& invoker;
+        Commands& commands;
+        std::stop_token stop;
+        std::coroutine_handle<> continuation;
+        std::atomic<std::size_t> next{ 0 };
+        std::atomic<std::size_t> active{ 0 };
+        std::mutex mutex;
+        std::exception_ptr error;
+    };
+
+    static detail::Detached Drive(Batch& batch) {
+        while (true) {
+            auto const index = batch.next.fetch_add(1, std::memory_order_relaxed);
+            if (index >= batch.commands.size() || batch.stop.stop_requested()) {
+                break;
+            }
+            try {
+                co_await batch.commands[index]->ExecuteAsync(
+                    AsyncContext{ batch.invoker.timer_, batch.stop }
+                );
+            }
+            catch (...) {
+                auto lock = std::lock_guard{ batch.mutex };
+                if (!batch.error) {
+                    batch.error = std::current_exception();
+                }
+            }
+        }
+        // 最后一条通道恢复Invoke，之后不能再访问batch
+        if (batch.active.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            batch.continuation.resume();
+        }
     }
 
-protected:
-    CommandList() = default;
+    ThreadPool& pool_;
+    std::size_t concurrency_;
+    detail::Timer timer_;
+};
 
-private:
-    std::vector<Command<T>> commands_;
+struct InvokeStatistics {
+    std::uint64_t batches  = 0;
+    std::uint64_t commands = 0;
+    // 依赖的命令抛出了异常而没有执行的命令
+    std::uint64_t skipped = 0;
+    std::chrono::nanoseconds last{ 0 };
+    std::chrono::nanoseconds min{ std::chrono::nanoseconds::max() };
+    std::chrono::nanoseconds max{ 0 };
+    std::chrono::nanoseconds total{ 0 };
+
+    [[nodiscard]] std::chrono::nanoseconds Average() const noexcept {
+        return batches == 0 ? std::chrono::nanoseconds{ 0 }
+                            : total / static_cast<std::int64_t>(batches);
+    }
 };
 
+/**
+ * @brief 在线程池上并行执行一批命令.
+ *
+ * 按添加顺序根据资源标注建立依赖：读依赖于上一个写者，写依赖于上一个写者以及其后的所有读者，
+ * 没有冲突的命令并行执行，冲突的命令保持添加的顺序.
+ * 命令抛出异常时，直接或间接依赖于它的命令被取消，计入skipped，其它命令照常执行；
+ * 整批结束之后Invoke重新抛出第一个异常.
+ * 同一个ParallelInvoker一次只能执行一批，依赖图使用的内存在批次之间复用.
+ */
 template <typename T>
-class Invoker {
+class ParallelInvoker {
 public:
-    using self_type = Invoker;
+    using self_type = ParallelInvoker;
 
-    virtual ~Invoker() = default;
+    explicit ParallelInvoker(ThreadPool& pool) : pool_(pool) {}
+
+    virtual ~ParallelInvoker() = default;
 
     template <typename List>
     requires std::is_base_of_v<CommandList<T>, std::decay_t<List>>
     void Invoke(List&& list) {
-        for (auto command : list.commands_) {
-            command.Execute();
+        auto& base = static_cast<CommandList<T>&>(list);
+        Run(base.commands_, base.access_);
+    }
+
+    // 没有资源标注，所有命令都可以并行
+    void Invoke(CommandBuffer<T>& buffer) { Run(buffer, {}); }
+
+    [[nodiscard]] InvokeStatistics GetStatistics() const {
+        auto lock = std::lock_guard{ mutex_ };
+        return statistics_;
+    }
+
+private:
+    struct Writer {
+        std::size_t last = kNone;
+        std::vector<std::size_t> readers;
+    };
+
+    static constexpr auto kNone = std::numeric_limits<std::size_t>::max();
+
+    void Run(CommandBuffer<T>& buffer, std::span<Access const> access) {
+        auto const start = std::chrono::steady_clock::now();
+
+        BuildGraph(buffer, access);
+        ready_.clear();
+        for (auto node = std::size_t{ 0 }; node < records_.size(); ++node) {
+            if (pending_[node].load(std::memory_order_relaxed) == 0) {
+                ready_.push_back(node);
+            }
+        }
+
+        // 一开始就可以执行的命令通常占大多数，分块提交以减少任务的开销
+        auto const grain = std::max<std::size_t>(ready_.size() / (pool_.size() * 8), 1);
+        auto group       = TaskGroup{ pool_ };
+        for (auto first = std::size_t{ 0 }; first < ready_.size(); first += grain) {
+            auto const size  = std::min(grain, ready_.size() - first);
+            auto const chunk = std::span{ ready_ }.subspan(first, size);
+            group.Run([this, &group, chunk]() {
+                for (auto node : chunk) {
+                    Execute(group, node);
+                }
+            });
+        }
+        group.Wait();
+
+        AddSample(
+            records_.size(),
+            skipped_.load(std::memory_order_relaxed),
+            std::chrono::steady_clock::now() - start
+        );
+        if (error_) {
+            std::rethrow_exception(std::exchange(error_, nullptr));
         }
     }
 
-protected:
-    Invoker() = default;
+    void BuildGraph(CommandBuffer<T>& buffer, std::span<Access const> access) {
+        auto const count = buffer.size();
+        records_.assign(buffer.begin(), buffer.end());
+        if (successors_.size() < count) {
+            successors_.resize(count);
+        }
+        for (auto node = std::size_t{ 0 }; node < count; ++node) {
+            successors_[node].clear();
+        }
+        if (capacity_ < count) {
+            pending_   = std::make_unique<std::atomic<std::size_t>[]>(count);
+            cancelled_ = std::make_unique<std::atomic<bool>[]>(count);
+            capacity_  = count;
+        }
+        for (auto node = std::size_t{ 0 }; node < count; ++node) {
+            cancelled_[node].store(false, std::memory_order_relaxed);
+        }
+        skipped_.store(0, std::memory_order_relaxed);
+
+        resources_.clear();
+        auto depend = [this](std::size_t from, std::size_t to, std::size_t& pending) {
+            if (from != kNone && from != to) {
+                successors_[from].push_back(to);
+                ++pending;
+            }
+        };
+        for (auto node = std::size_t{ 0 }; node < count; ++node) {
+            auto pending = std::size_t{ 0 };
+            if (node < access.size()) {
+                for (auto resource : access[node].reads) {
+                    auto& writer = resources_[resource];
+                    depend(writer.last, node, pending);
+                    writer.readers.push_back(node);
+                }
+                for (auto resource : access[node].writes) {
+                    auto& writer = resources_[resource];
+                    depend(writer.last, node, pending);
+                    for (auto reader : writer.readers) {
+                        depend(reader, node, pending);
+                    }
+                    writer.last = node;
+                    writer.readers.clear();
+                }
+            }
+            pending_[node].store(pending, std::memory_order_relaxed);
+        }
+    }
+
+    // 执行完之后释放依赖于它的命令；抛出异常或者已被取消时，依赖于它的命令也被取消.
+    // 异常不向外传播，这样同一块中其它不相关的命令仍然会执行
+    void Execute(TaskGroup& group, std::size_t node) {
+        auto cancelled = cancelled_[node].load(std::memory_order_relaxed);
+        if (cancelled) {
+            skipped_.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+            try {
+                records_[node].Execute();
+            }
+            catch (...) {
+                cancelled = true;
+                auto lock = std::lock_guard{ mutex_ };
+                if (!error_) {
+                    error_ = std::current_exception();
+                }
+            }
+        }
+        for (auto successor : successors_[node]) {
+            // 由fetch_sub发布给最后释放它的线程
+            if (cancelled) {
+                cancelled_[successor].store(true, std::memory_order_relaxed);
+            }
+            if (pending_[successor].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                group.Run([this, &group, successor]() { Execute(group, successor); });
+            }
+        }
+    }
+
+    void AddSample(std::size_t commands, std::size_t skipped, std::chrono::nanoseconds elapsed) {
+        auto lock = std::lock_guard{ mutex_ };
+        ++statistics_.batches;
+        statistics_.commands += commands;
+        statistics_.skipped += skipped;
+        statistics_.last = elapsed;
+        statistics_.min  = std::min(statistics_.min, elapsed);
+        statistics_.max  = std::max(statistics_.max, elapsed);
+        statistics_.total += elapsed;
+    }
+
+    ThreadPool& pool_;
+    std::vector<typename CommandBuffer<T>::Record> records_;
+    std::vector<std::vector<std::size_t>> successors_;
+    std::unique_ptr<std::atomic<std::size_t>[]> pending_;
+    std::unique_ptr<std::atomic<bool>[]> cancelled_;
+    std::size_t capacity_ = 0;
+    std::vector<std::size_t> ready_;
+    std::unordered_map<ResourceId, Writer> resources_;
+    std::atomic<std::size_t> skipped_{ 0 };
+
+    // 保护statistics_和本批的第一个异常
+    mutable std::mutex mutex_;
+    InvokeStatistics statistics_;
+    std::exception_ptr error_;
 };
 } // namespace command
 
@@ -362,9 +4593,71 @@ public:
     virtual void SetNextHandler(Handler<T>& next) { next_ = &next; }
 
 protected:
-    Handler<T>* next_;
+    Handler<T>* next_ = nullptr;
+};
+
+// 处理者尝试处理请求，返回true表示已经处理
+template <typename H, typename Request>
+concept ChainHandler = requires(H& handler, Request& request) {
+    { handler.TryHandle(request) } -> std::convertible_to<bool>;
+};
+
+/**
+ * @brief 编译期确定的职责链.
+ *
+ * 处理者按模板参数的顺序依次尝试，第一个返回true的处理者之后不再继续.
+ * 调用全部是静态的，没有间接调用，编译器可以把整条链内联成一组分支.
+ * 需要在运行期调整顺序时使用Handler.
+ * @tparam Handlers 提供bool TryHandle(Request&)的处理者
+ */
+template <typename... Handlers>
+class StaticChain {
+public:
+    using self_type = StaticChain;
+
+    StaticChain() = default;
+
+    explicit StaticChain(Handlers... handlers) : handlers_(std::move(handlers)...) {}
+
+    // 返回是否有处理者处理了请求
+    template <typename Request>
+    requires(ChainHandler<Handlers, std::remove_reference_t<Request>> && ...)
+    bool Handle(Request&& request) {
+        return std::apply(
+            [&request](Handlers&... handlers) {
+                return (static_cast<bool>(handlers.TryHandle(request)) || ...);
+            },
+            handlers_
+        );
+    }
+
+    template <typename H>
+    requires meta::IsUnique<Handlers...>
+    [[nodiscard]] H& Get() noexcept {
+        return std::get<H>(handlers_);
+    }
+
+    template <std::size_t Index>
+    [[nodiscard]] auto& Get() noexcept {
+        return std::get<Index>(handlers_);
+    }
+
+private:
+    std::tuple<Handlers...> handlers_;
+};
+
+template <typename List>
+struct MakeStaticChain;
+
+template <typename... Handlers>
+struct MakeStaticChain<meta::TypeList<Handlers...>> {
+    using type = StaticChain<Handlers...>;
 };
 
+// 由类型列表得到的职责链
+template <typename List>
+using StaticChainOf = typename MakeStaticChain<List>::type;
+
 namespace state {
 template <typename T>
 class State {
@@ -381,7 +4674,7 @@ public:
     template <typename StateType>
     requires std::is_base_of_v<State<T>, StateType>
     void Set(StateType state) {
-        state_.reset(std::make_unique<StateType>());
+        state_ = std::make_unique<StateType>(std::move(state));
     }
 
     template <typename StateType>
@@ -394,6 +4687,165 @@ public:
 protected:
     std::unique_ptr<State<T>> state_;
 };
+
+// 转移表中的一行：处于From时收到Event转到To
+template <typename From, typename Event, typename To>
+struct Transition {
+    using from_type  = From;
+    using event_type = Event;
+    using to_type    = To;
+};
+
+template <typename States, typename Transitions>
+class StateMachine;
+
+/**
+ * @brief 表驱动的状态机.
+ *
+ * 状态保存在std::variant中，当前状态就是variant的下标，Is<S>()只比较下标，不需要RTTI.
+ * 转移表在编译期由Transition生成，按(状态, 事件)索引：每个事件有一个按状态下标索引的函数指针数组，
+ * Dispatch只查一次表、做一次间接调用，新状态直接构造在variant中，不分配内存.
+ * 转移时依次调用旧状态的OnExit、构造新状态（可以由事件构造时使用事件）、调用新状态的OnEntry，
+ * OnExit和OnEntry都是可选的，可以接受事件作为参数. 同一个(状态, 事件)只有第一行有效，
+ * 没有对应转移的事件被忽略. 初始状态是第一个状态，不调用OnEntry.
+ * @tparam States 状态，构造不能抛出异常
+ * @tparam Transitions 转移表
+ */
+template <typename... States, typename... Transitions>
+requires meta::IsUnique<States...>
+class StateMachine<meta::TypeList<States...>, meta::TypeList<Transitions...>> {
+public:
+    using self_type    = StateMachine;
+    using variant_type = std::variant<States...>;
+
+    static constexpr auto kNone = std::numeric_limits<std::size_t>::max();
+
+    // 状态在列表中的下标
+    template <typename S>
+    static constexpr std::size_t IndexOf = []() {
+        constexpr bool matches[] = { std::is_same_v<S, States>... };
+        for (auto index = std::size_t{ 0 }; index < sizeof...(States); ++index) {
+            if (matches[index]) {
+                return index;
+            }
+        }
+        return kNone;
+    }();
+
+    /**
+     * @brief 处于每个状态时收到Event之后的状态下标.
+     *
+     * 没有对应的转移时是kNone.
+     */
+    template <typename Event>
+    static constexpr auto kTargets = []() {
+        auto targets = std::array<std::size_t, sizeof...(States)>{};
+        targets.fill(kNone);
+        (
+            [&targets]() {
+                using Row = Transitions;
+                if constexpr (std::is_same_v<typename Row::event_type, Event>) {
+                    static_assert(IndexOf<typename Row::from_type> != kNone, "unknown state");
+                    static_assert(IndexOf<typename Row::to_type> != kNone, "unknown state");
+                    auto& target = targets[IndexOf<typename Row::from_type>];
+                    if (target == kNone) {
+                        target = IndexOf<typename Row::to_type>;
+                    }
+                }
+            }(),
+            ...
+        );
+        return targets;
+    }();
+
+    StateMachine() = default;
+
+    template <typename Initial, typename... Args>
+    requires(IndexOf<Initial> != kNone)
+    explicit StateMachine(std::in_place_type_t<Initial> initial, Args&&... args)
+        : state_(initial, std::forward<Args>(args)...) {}
+
+    // 返回是否发生了转移
+    template <typename Event>
+    bool Dispatch(Event const& event) {
+        if (auto const step = kSteps<Event>[state_.index()]) {
+            step(*this, event);
+            return true;
+        }
+        return false;
+    }
+
+    template <typename S>
+    requires(IndexOf<S> != kNone)
+    [[nodiscard]] bool Is() const noexcept {
+        return state_.index() == IndexOf<S>;
+    }
+
+    [[nodiscard]] std::size_t Index() const noexcept { return state_.index(); }
+
+    // 不是当前状态时抛出std::bad_variant_access
+    template <typename S>
+    [[nodiscard]] S& Get() {
+        return std::get<S>(state_);
+    }
+
+    template <typename S>
+    [[nodiscard]] S const& Get() const {
+        return std::get<S>(state_);
+    }
+
+private:
+    template <typename Event>
+    using Step = void (*)(StateMachine&, Event const&);
+
+    template <typename Event, std::size_t From>
+    static constexpr Step<Event> StepFor() noexcept {
+        constexpr auto to = kTargets<Event>[From];
+        if constexpr (to == kNone) {
+            return nullptr;
+        }
+        else {
+            return &Transit<Event, From, to>;
+        }
+    }
+
+    template <typename Event>
+    static constexpr auto kSteps = []<std::size_t... From>(std::index_sequence<From...>) {
+        return std::array<Step<Event>, sizeof...(States)>{ StepFor<Event, From>()... };
+    }(std::index_sequence_for<States...>{});
+
+    template <typename Event, std::size_t From, std::size_t To>
+    static void Transit(StateMachine& machine, Event const& event) {
+        using ToState = std::variant_alternative_t<To, variant_type>;
+
+        auto& from = *std::get_if<From>(&machine.state_);
+        if constexpr (requires { from.OnExit(event); }) {
+            from.OnExit(event);
+        }
+        else if constexpr (requires { from.OnExit(); }) {
+            from.OnExit();
+        }
+
+        auto& to = [&]() -> ToState& {
+            if constexpr (std::is_constructible_v<ToState, Event const&>) {
+                static_assert(std::is_nothrow_constructible_v<ToState, Event const&>);
+                return machine.state_.template emplace<To>(event);
+            }
+            else {
+                static_assert(std::is_nothrow_default_constructible_v<ToState>);
+                return machine.state_.template emplace<To>();
+            }
+        }();
+        if constexpr (requires { to.OnEntry(event); }) {
+            to.OnEntry(event);
+        }
+        else if constexpr (requires { to.OnEntry(); }) {
+            to.OnEntry();
+        }
+    }
+
+    variant_type state_;
+};
 } // namespace state
 
 namespace observer {
@@ -604,3 +5056,8 @@ protected:
 };
 } // namespace decorator
 } // namespace patterns
+
+// 视图只保存根节点的指针，迭代器可以比视图活得更久
+template <typename Iterator>
+inline constexpr bool
+    std::ranges::enable_borrowed_range<patterns::composite::TraversalView<Iterator>> = true;
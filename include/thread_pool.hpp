@@ -0,0 +1,318 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace patterns {
+/**
+ * @brief 只能移动的void()任务.
+ *
+ * 不超过kCapacity字节、移动不抛异常的可调用对象存放在内部缓冲区中，不分配堆内存；
+ * 其它的可调用对象放在堆上.调用空的任务抛出std::bad_function_call.
+ */
+class MoveOnlyTask {
+public:
+    static constexpr std::size_t kCapacity = 48;
+
+    using self_type = MoveOnlyTask;
+
+    MoveOnlyTask() noexcept = default;
+    MoveOnlyTask(std::nullptr_t) noexcept {}
+
+    template <typename F>
+    requires(!std::is_same_v<std::decay_t<F>, MoveOnlyTask>) &&
+            std::is_invocable_v<std::decay_t<F>&>
+    MoveOnlyTask(F&& function) {
+        using function_type = std::decay_t<F>;
+        if constexpr (kInline<function_type>) {
+            ::new (static_cast<void*>(storage_)) function_type(std::forward<F>(function));
+            ops_ = &kInlineOps<function_type>;
+        }
+        else {
+            ::new (static_cast<void*>(storage_))
+                function_type*(new function_type(std::forward<F>(function)));
+            ops_ = &kHeapOps<function_type>;
+        }
+    }
+
+    MoveOnlyTask(MoveOnlyTask const&)            = delete;
+    MoveOnlyTask& operator=(MoveOnlyTask const&) = delete;
+
+    MoveOnlyTask(MoveOnlyTask&& other) noexcept : ops_(other.ops_) {
+        ops_->move(other.storage_, storage_);
+        other.ops_ = &kEmpty;
+    }
+
+    MoveOnlyTask& operator=(MoveOnlyTask&& other) noexcept {
+        if (this != &other) {
+            ops_->destroy(storage_);
+            ops_ = std::exchange(other.ops_, &kEmpty);
+            ops_->move(other.storage_, storage_);
+        }
+        return *this;
+    }
+
+    ~MoveOnlyTask() { ops_->destroy(storage_); }
+
+    void operator()() { ops_->invoke(storage_); }
+
+    explicit operator bool() const noexcept { return ops_ != &kEmpty; }
+
+private:
+    struct Ops {
+        void (*invoke)(void*);
+        void (*move)(void*, void*) noexcept;
+        void (*destroy)(void*) noexcept;
+    };
+
+    template <typename F>
+    static constexpr bool kInline = sizeof(F) <= kCapacity &&
+                                    alignof(F) <= alignof(std::max_align_t) &&
+                                    std::is_nothrow_move_constructible_v<F>;
+
+    static constexpr Ops kEmpty{
+        [](void*) { throw std::bad_function_call{}; },
+        [](void*, void*) noexcept {},
+        [](void*) noexcept {},
+    };
+
+    template <typename F>
+    static constexpr Ops kInlineOps{
+        [](void* self) { (*static_cast<F*>(self))(); },
+        [](void* from, void* to) noexcept {
+            ::new (to) F(std::move(*static_cast<F*>(from)));
+            std::destroy_at(static_cast<F*>(from));
+        },
+        [](void* self) noexcept { std::destroy_at(static_cast<F*>(self)); },
+    };
+
+    // 缓冲区中只存放指向堆上对象的指针
+    template <typename F>
+    static constexpr Ops kHeapOps{
+        [](void* self) { (**static_cast<F**>(self))(); },
+        [](void* from, void* to) noexcept { ::new (to) F*(*static_cast<F**>(from)); },
+        [](void* self) noexcept { delete *static_cast<F**>(self); },
+    };
+
+    alignas(std::max_align_t) std::byte storage_[kCapacity];
+    Ops const* ops_ = &kEmpty;
+};
+
+/**
+ * @brief 工作窃取线程池.
+ *
+ * 每个工作线程有自己的任务队列，线程自己从队尾取任务（LIFO，缓存友好），
+ * 自己的队列空了就从其它线程的队首窃取（FIFO，偷走的通常是较大的任务）.
+ * 工作线程中提交的任务进入自己的队列，其它线程提交的任务轮流分给各个工作线程.
+ * 提交和取走任务只修改原子计数，只有工作线程入睡和唤醒入睡的线程时才用到全局的锁.
+ */
+class ThreadPool {
+public:
+    using task_type = MoveOnlyTask;
+    using self_type = ThreadPool;
+
+    explicit ThreadPool(std::size_t thread_count = std::thread::hardware_concurrency())
+        : workers_(std::max<std::size_t>(thread_count, 1)) {
+        for (auto& worker : workers_) {
+            worker = std::make_unique<Worker>();
+        }
+        threads_.reserve(workers_.size());
+        for (auto index = std::size_t{ 0 }; index < workers_.size(); ++index) {
+            threads_.emplace_back([this, index]() { Run(index); });
+        }
+    }
+
+    ThreadPool(ThreadPool const&)            = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    // 析构前已经提交的任务都会执行完
+    ~ThreadPool() {
+        {
+            auto lock = std::lock_guard{ sleep_mutex_ };
+            stop_     = true;
+        }
+        sleep_condition_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept { return workers_.size(); }
+
+    template <typename Task>
+    void Submit(Task&& task) {
+        auto const index = current_pool_ == this
+                               ? current_index_
+                               : next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+        // 与Run中的入睡配对：这里先计数再检查sleeping_，入睡的线程先登记再检查pending_，
+        // 两边都是seq_cst，至少有一边能看到对方，不会错过唤醒
+        pending_.fetch_add(1, std::memory_order_seq_cst);
+        try {
+            auto& worker = *workers_[index];
+            auto lock    = std::lock_guard{ worker.mutex };
+            worker.tasks.emplace_back(std::forward<Task>(task));
+        }
+        catch (...) {
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            throw;
+        }
+        if (sleeping_.load(std::memory_order_seq_cst) != 0) {
+            // 加锁保证正在检查条件的线程已经进入等待
+            auto lock = std::lock_guard{ sleep_mutex_ };
+            sleep_condition_.notify_one();
+        }
+    }
+
+    /**
+     * @brief 在当前线程上执行一个排队中的任务，等待其它任务完成时用来帮忙.
+     *
+     * @return true 执行了一个任务
+     * @return false 没有可以执行的任务
+     */
+    bool RunOne() {
+        auto const index = current_pool_ == this ? current_index_ : std::size_t{ 0 };
+        if (auto task = Take(index, current_pool_ == this)) {
+            task();
+            return true;
+        }
+        return false;
+    }
+
+    // 当前线程是否是这个池的工作线程
+    [[nodiscard]] bool InWorker() const noexcept { return current_pool_ == this; }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<task_type> tasks;
+    };
+
+    task_type Take(std::size_t index, bool own) {
+        if (own) {
+            auto& worker = *workers_[index];
+            auto lock    = std::lock_guard{ worker.mutex };
+            if (!worker.tasks.empty()) {
+                auto task = std::move(worker.tasks.back());
+                worker.tasks.pop_back();
+                Taken();
+                return task;
+            }
+        }
+        for (auto offset = std::size_t{ own ? 1U : 0U }; offset < workers_.size(); ++offset) {
+            auto& victim = *workers_[(index + offset) % workers_.size()];
+            auto lock    = std::lock_guard{ victim.mutex };
+            if (!victim.tasks.empty()) {
+                auto task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                Taken();
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    void Taken() noexcept { pending_.fetch_sub(1, std::memory_order_relaxed); }
+
+    void Run(std::size_t index) {
+        current_pool_  = this;
+        current_index_ = index;
+        while (true) {
+            if (auto task = Take(index, true)) {
+                task();
+                continue;
+            }
+            auto lock = std::unique_lock{ sleep_mutex_ };
+            sleeping_.fetch_add(1, std::memory_order_seq_cst);
+            sleep_condition_.wait(lock, [this]() {
+                return stop_ || pending_.load(std::memory_order_seq_cst) != 0;
+            });
+            sleeping_.fetch_sub(1, std::memory_order_relaxed);
+            if (stop_ && pending_.load(std::memory_order_relaxed) == 0) {
+                return;
+            }
+        }
+    }
+
+    inline static thread_local ThreadPool* current_pool_ = nullptr;
+    inline static thread_local std::size_t current_index_ = 0;
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<std::size_t> next_{ 0 };
+
+    // 已提交还没有被取走的任务数，可能短暂地多于队列中的任务
+    std::atomic<std::size_t> pending_{ 0 };
+    std::atomic<std::size_t> sleeping_{ 0 };
+
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_condition_;
+    bool stop_ = false;
+};
+
+/**
+ * @brief fork-join用的任务组.
+ *
+ * Wait时当前线程会帮忙执行池中的任务，所以可以在工作线程中嵌套使用而不会死锁.
+ * 任务抛出的第一个异常会在Wait中重新抛出.
+ */
+class TaskGroup {
+public:
+    using self_type = TaskGroup;
+
+    explicit TaskGroup(ThreadPool& pool) : pool_(pool) {}
+
+    TaskGroup(TaskGroup const&)            = delete;
+    TaskGroup& operator=(TaskGroup const&) = delete;
+
+    ~TaskGroup() { WaitAll(); }
+
+    template <typename Task>
+    void Run(Task&& task) {
+        pending_.fetch_add(1, std::memory_order_relaxed);
+        pool_.Submit([this, task = std::forward<Task>(task)]() mutable {
+            try {
+                task();
+            }
+            catch (...) {
+                auto lock = std::lock_guard{ exception_mutex_ };
+                if (!exception_) {
+                    exception_ = std::current_exception();
+                }
+            }
+            pending_.fetch_sub(1, std::memory_order_acq_rel);
+        });
+    }
+
+    void Wait() {
+        WaitAll();
+        if (exception_) {
+            std::rethrow_exception(std::exchange(exception_, nullptr));
+        }
+    }
+
+private:
+    void WaitAll() {
+        while (pending_.load(std::memory_order_acquire) != 0) {
+            if (!pool_.RunOne()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    ThreadPool& pool_;
+    std::atomic<std::size_t> pending_{ 0 };
+    std::mutex exception_mutex_;
+    std::exception_ptr exception_;
+};
+} // namespace patterns
@@ -0,0 +1,1092 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <ranges>
+#include <span>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// 基准测试默认不运行，使用 "[benchmark]" 标签运行
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include <catch.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include "cpu_dispatch.hpp"
+#include "pattern.hpp"
+
+using namespace patterns;
+
+namespace {
+constexpr auto kChurnThreads    = 4;
+constexpr auto kChurnIterations = 20000;
+constexpr auto kChurnWindow     = 64;
+
+class Particle : public simplefactory::Product<Particle> {
+public:
+    explicit Particle(int id) : id(id) {}
+
+    int id;
+    std::array<float, 6> state{};
+};
+
+class HeapParticleFactory : public simplefactory::SimpleFactory<Particle> {
+public:
+    HeapParticleFactory() = default;
+};
+
+class SharedPoolParticleFactory : public simplefactory::PooledSimpleFactory<Particle> {
+public:
+    SharedPoolParticleFactory() = default;
+};
+
+class LocalPoolParticleFactory
+    : public simplefactory::PooledSimpleFactory<Particle, std::pmr::unsynchronized_pool_resource> {
+public:
+    LocalPoolParticleFactory() = default;
+};
+
+// 每个线程维持一个固定大小的窗口，不断用新产品替换旧产品
+template <typename Factory>
+int Churn(Factory& factory) {
+    auto window = std::array<std::shared_ptr<Particle>, kChurnWindow>{};
+    auto sum    = 0;
+    for (auto i = 0; i < kChurnIterations; ++i) {
+        auto& slot = window[i % kChurnWindow];
+        slot       = factory.template Create<Particle>(i);
+        sum += slot->id;
+    }
+    return sum;
+}
+
+template <typename Function>
+void RunOnThreads(Function&& function) {
+    auto threads = std::vector<std::thread>{};
+    threads.reserve(kChurnThreads);
+    for (auto i = 0; i < kChurnThreads; ++i) {
+        threads.emplace_back(function);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+TEST_CASE("factory creation under churn", "[.][benchmark]") {
+    BENCHMARK("heap, shared factory") {
+        auto factory = HeapParticleFactory{};
+        RunOnThreads([&factory]() { Churn(factory); });
+    };
+
+    BENCHMARK("synchronized pool, shared factory") {
+        auto factory = SharedPoolParticleFactory{};
+        RunOnThreads([&factory]() { Churn(factory); });
+    };
+
+    BENCHMARK("unsynchronized pool, factory per thread") {
+        RunOnThreads([]() {
+            auto factory = LocalPoolParticleFactory{};
+            Churn(factory);
+        });
+    };
+}
+} // namespace
+
+namespace {
+constexpr auto kClones     = 1000;
+constexpr auto kWriteEvery = 10;
+
+// 大部分数据内联在对象中的大配置
+class LargeConfig : public prototype::Clonable<LargeConfig> {
+public:
+    LargeConfig() = default;
+
+    std::array<double, 1024> weights{};
+    std::string name = "large config";
+};
+
+class LargeConfigRegistry : public prototype::Registry<LargeConfig> {
+public:
+    LargeConfigRegistry() = default;
+};
+
+TEST_CASE("prototype clone", "[.][benchmark]") {
+    auto config   = LargeConfig{};
+    auto registry = LargeConfigRegistry{};
+    registry.Register("large", config);
+
+    BENCHMARK("deep Clone") { return config.Clone(); };
+
+    BENCHMARK("copy-on-write Clone from registry") { return registry.Clone("large"); };
+
+    auto* storage = ::operator new(registry.CloneSize("large"));
+    BENCHMARK("CloneInto preallocated storage") {
+        auto* clone = registry.CloneInto("large", storage);
+        std::destroy_at(clone);
+    };
+    ::operator delete(storage);
+
+    // 持有一批克隆、其中一部分被修改时实际存在的对象
+    auto deep = std::vector<std::shared_ptr<Prototype>>{};
+    auto cows = std::vector<prototype::Cow<LargeConfig>>{};
+    for (auto i = 0; i < kClones; ++i) {
+        deep.push_back(config.Clone());
+        cows.push_back(registry.Clone("large"));
+        if (i % kWriteEvery == 0) {
+            cows.back().Write().weights[0] = i;
+        }
+    }
+    auto objects = std::unordered_set<LargeConfig const*>{};
+    for (auto const& cow : cows) {
+        objects.insert(&cow.Read());
+    }
+    auto const deep_bytes = deep.size() * sizeof(LargeConfig);
+    auto const cow_bytes  = objects.size() * sizeof(LargeConfig) + cows.size() * sizeof(cows[0]);
+    WARN(
+        kClones << " clones, 1 in " << kWriteEvery << " written: deep " << deep_bytes / 1024
+                << " KiB, copy-on-write " << cow_bytes / 1024 << " KiB (" << objects.size()
+                << " objects)"
+    );
+}
+} // namespace
+
+namespace {
+struct Cost {};
+
+class CostNode : public composite::Composite<Cost> {
+public:
+    explicit CostNode(std::uint64_t cost) : cost(cost) {}
+    std::uint64_t cost;
+};
+
+std::shared_ptr<CostNode> BuildTree(int fan_out, int depth, std::uint64_t& seed) {
+    auto node = std::make_shared<CostNode>(seed++);
+    if (depth > 0) {
+        for (auto i = 0; i < fan_out; ++i) {
+            node->Add(BuildTree(fan_out, depth - 1, seed));
+        }
+    }
+    return node;
+}
+
+// 每个节点做一点计算，避免只测到内存带宽
+std::uint64_t NodeCost(composite::Component<Cost>& node) {
+    auto value = static_cast<CostNode&>(node).cost;
+    for (auto i = 0; i < 16; ++i) {
+        value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    return value >> 32;
+}
+
+std::uint64_t SequentialCost(composite::Component<Cost>& node) {
+    auto total = NodeCost(node);
+    for (auto const& child : node.Children()) {
+        total += SequentialCost(*child);
+    }
+    return total;
+}
+
+void BenchmarkTree(int fan_out, int depth) {
+    auto seed = std::uint64_t{ 0 };
+    auto root = BuildTree(fan_out, depth, seed);
+    auto pool = ThreadPool{};
+
+    auto const name = std::to_string(fan_out) + "x" + std::to_string(depth);
+    BENCHMARK("recursive " + name) { return SequentialCost(*root); };
+    BENCHMARK("parallel " + name) {
+        return composite::Reduce(pool, *root, NodeCost, std::plus<>{});
+    };
+}
+
+TEST_CASE("composite reduce", "[.][benchmark]") {
+    BenchmarkTree(1000, 2);
+    BenchmarkTree(10, 6);
+    BenchmarkTree(2, 20);
+}
+} // namespace
+
+namespace {
+constexpr auto kTaskCount = 10000;
+
+// 任务本身几乎不做事，测的是提交和取走任务的开销
+TEST_CASE("thread pool submit", "[.][benchmark]") {
+    auto pool    = ThreadPool{};
+    auto results = std::vector<std::uint64_t>(kTaskCount);
+
+    BENCHMARK("submit small tasks") {
+        auto group = TaskGroup{ pool };
+        for (auto i = 0; i < kTaskCount; ++i) {
+            group.Run([&results, i]() { results[i] += i; });
+        }
+        group.Wait();
+        return results[kTaskCount - 1];
+    };
+}
+} // namespace
+
+namespace {
+struct Step {};
+
+class StepNode : public composite::Composite<Step> {
+public:
+    explicit StepNode(std::uint64_t value) : value(value) {}
+    std::uint64_t value;
+};
+
+// 又深又窄的树：一条主干，每层挂一个叶子
+std::shared_ptr<StepNode> BuildSpine(int depth) {
+    auto root = std::make_shared<StepNode>(0);
+    auto tail = root;
+    for (auto i = 1; i < depth; ++i) {
+        auto next = std::make_shared<StepNode>(i);
+        tail->Add(std::make_shared<StepNode>(i));
+        tail->Add(next);
+        tail = next;
+    }
+    return root;
+}
+
+std::uint64_t Value(composite::Component<Step>& node) {
+    return static_cast<StepNode&>(node).value;
+}
+
+void RecursivePreOrder(composite::Component<Step>& node, std::vector<std::uint64_t>& out) {
+    out.push_back(Value(node));
+    for (auto const& child : node.Children()) {
+        RecursivePreOrder(*child, out);
+    }
+}
+
+// 常见的写法：先递归地把节点收集到vector中再处理
+std::uint64_t RecursiveCollect(composite::Component<Step>& node) {
+    auto nodes = std::vector<std::uint64_t>{};
+    RecursivePreOrder(node, nodes);
+    auto total = std::uint64_t{ 0 };
+    for (auto value : nodes) {
+        total += value;
+    }
+    return total;
+}
+
+std::uint64_t RecursiveSum(composite::Component<Step>& node) {
+    auto total = Value(node);
+    for (auto const& child : node.Children()) {
+        total += RecursiveSum(*child);
+    }
+    return total;
+}
+
+template <typename Range>
+std::uint64_t RangeSum(Range&& range) {
+    auto total = std::uint64_t{ 0 };
+    for (auto& node : range) {
+        total += Value(node);
+    }
+    return total;
+}
+
+TEST_CASE("composite traversal", "[.][benchmark]") {
+    // 结束时的析构本身是递归的，深度不能太大
+    auto root = BuildSpine(10000);
+
+    BENCHMARK("recursive, collect into vector") { return RecursiveCollect(*root); };
+    BENCHMARK("recursive sum") { return RecursiveSum(*root); };
+    BENCHMARK("pre-order view") { return RangeSum(composite::PreOrder(*root)); };
+    BENCHMARK("post-order view") { return RangeSum(composite::PostOrder(*root)); };
+    BENCHMARK("breadth-first view") { return RangeSum(composite::BreadthFirst(*root)); };
+    BENCHMARK("pre-order view | filter") {
+        return RangeSum(composite::PreOrder(*root) | std::views::filter([](auto& node) {
+                            return node.Children().empty();
+                        }));
+    };
+}
+} // namespace
+
+namespace {
+constexpr auto kShapeCount = 10'000'000;
+
+// 经典的虚函数双分派
+class ShapeVisitor;
+
+class Shape {
+public:
+    virtual ~Shape()                           = default;
+    virtual void Accept(ShapeVisitor& visitor) = 0;
+};
+
+class Circle;
+class Square;
+class Rectangle;
+
+class ShapeVisitor {
+public:
+    virtual ~ShapeVisitor()                  = default;
+    virtual void Visit(Circle& circle)       = 0;
+    virtual void Visit(Square& square)       = 0;
+    virtual void Visit(Rectangle& rectangle) = 0;
+};
+
+class Circle : public Shape {
+public:
+    explicit Circle(double radius) : radius(radius) {}
+    void Accept(ShapeVisitor& visitor) override { visitor.Visit(*this); }
+    double radius;
+};
+
+class Square : public Shape {
+public:
+    explicit Square(double side) : side(side) {}
+    void Accept(ShapeVisitor& visitor) override { visitor.Visit(*this); }
+    double side;
+};
+
+class Rectangle : public Shape {
+public:
+    Rectangle(double width, double height) : width(width), height(height) {}
+    void Accept(ShapeVisitor& visitor) override { visitor.Visit(*this); }
+    double width;
+    double height;
+};
+
+class AreaVisitor final : public ShapeVisitor {
+public:
+    void Visit(Circle& circle) override { area += 3.14159 * circle.radius * circle.radius; }
+    void Visit(Square& square) override { area += square.side * square.side; }
+    void Visit(Rectangle& rectangle) override { area += rectangle.width * rectangle.height; }
+    double area = 0;
+};
+
+// 同样的元素，按值存放在variant中
+struct CircleValue {
+    double radius;
+};
+
+struct SquareValue {
+    double side;
+};
+
+struct RectangleValue {
+    double width;
+    double height;
+};
+
+// kind(i)决定第i个元素的类型
+template <typename Kind>
+void BenchmarkDispatch(std::string const& name, Kind kind) {
+    auto shapes   = std::vector<std::unique_ptr<Shape>>{};
+    auto elements = visitor::ElementSet<CircleValue, SquareValue, RectangleValue>{};
+    shapes.reserve(kShapeCount);
+    elements.Reserve(kShapeCount);
+
+    for (auto i = 0; i < kShapeCount; ++i) {
+        auto const size = static_cast<double>(i % 7 + 1);
+        switch (kind(i)) {
+        case 0:
+            shapes.push_back(std::make_unique<Circle>(size));
+            elements.Add<CircleValue>(size);
+            break;
+        case 1:
+            shapes.push_back(std::make_unique<Square>(size));
+            elements.Add<SquareValue>(size);
+            break;
+        default:
+            shapes.push_back(std::make_unique<Rectangle>(size, size + 1));
+            elements.Add<RectangleValue>(size, size + 1);
+            break;
+        }
+    }
+
+    BENCHMARK("virtual double dispatch, " + name) {
+        auto visitor = AreaVisitor{};
+        for (auto& shape : shapes) {
+            shape->Accept(visitor);
+        }
+        return visitor.area;
+    };
+
+    BENCHMARK("variant dispatch, " + name) {
+        auto area = 0.0;
+        elements.Accept(visitor::Overloaded{
+            [&area](CircleValue const& circle) { area += 3.14159 * circle.radius * circle.radius; },
+            [&area](SquareValue const& square) { area += square.side * square.side; },
+            [&area](RectangleValue const& rectangle) {
+                area += rectangle.width * rectangle.height;
+            },
+        });
+        return area;
+    };
+}
+
+TEST_CASE("visitor dispatch", "[.][benchmark]") {
+    // 类型随机分布，分支预测器记不住顺序
+    auto seed = std::uint64_t{ 42 };
+    BenchmarkDispatch("random order", [&seed](int) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        return static_cast<int>((seed >> 33) % 3);
+    });
+    // 同类型的元素排在一起，只剩下分派本身的开销
+    BenchmarkDispatch("grouped by type", [](int i) {
+        return static_cast<int>(static_cast<std::int64_t>(i) * 3 / kShapeCount);
+    });
+}
+} // namespace
+
+namespace {
+constexpr auto kPartCount = 10'000'000;
+
+struct CpuPart {
+    int price;
+};
+
+struct MemoryPart {
+    int price;
+    int size;
+};
+
+class PriceSum {
+public:
+    void operator()(CpuPart const& cpu) { total += cpu.price; }
+    void operator()(MemoryPart const& memory) { total += memory.price; }
+    std::int64_t total = 0;
+};
+
+// 同样的计算，每个桶一个循环
+class PriceSpanSum {
+public:
+    void operator()(std::span<CpuPart const> cpus) {
+        for (auto const& cpu : cpus) {
+            total += cpu.price;
+        }
+    }
+    void operator()(std::span<MemoryPart const> memories) {
+        for (auto const& memory : memories) {
+            total += memory.price;
+        }
+    }
+    std::int64_t total = 0;
+};
+
+TEST_CASE("visitor buckets", "[.][benchmark]") {
+    auto mixed   = visitor::ElementSet<CpuPart, MemoryPart>{};
+    auto buckets = visitor::BucketSet<CpuPart, MemoryPart>{};
+    mixed.Reserve(kPartCount);
+
+    auto seed = std::uint64_t{ 7 };
+    for (auto i = 0; i < kPartCount; ++i) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        if ((seed >> 33) % 2 == 0) {
+            mixed.Add<CpuPart>(i % 1000);
+            buckets.Add<CpuPart>(i % 1000);
+        }
+        else {
+            mixed.Add<MemoryPart>(i % 500, 16);
+            buckets.Add<MemoryPart>(i % 500, 16);
+        }
+    }
+
+    BENCHMARK("mixed variant list") {
+        auto sum = PriceSum{};
+        mixed.Accept(sum);
+        return sum.total;
+    };
+
+    BENCHMARK("buckets, per element") {
+        auto sum = PriceSum{};
+        buckets.VisitAll(sum);
+        return sum.total;
+    };
+
+    BENCHMARK("buckets, span") {
+        auto sum = PriceSpanSum{};
+        buckets.VisitSpans(sum);
+        return sum.total;
+    };
+}
+} // namespace
+
+namespace {
+constexpr auto kInvokeCount = 1000;
+
+// 捕获24字节，超出了libstdc++中std::function的内联缓冲区
+struct Scale {
+    std::int64_t factor;
+    std::int64_t offset;
+    std::int64_t const* bias;
+
+    std::int64_t operator()(std::int64_t value) const { return value * factor + offset + *bias; }
+};
+
+std::int64_t ScaleByTwo(std::int64_t value) {
+    return value * 2 + 1;
+}
+
+template <typename Invoker>
+std::int64_t InvokeLoop(Invoker& invoker) {
+    auto total = std::int64_t{ 0 };
+    for (auto i = 0; i < kInvokeCount; ++i) {
+        total += invoker.Invoke(i);
+    }
+    return total;
+}
+
+template <typename Storage>
+void BenchmarkStrategy(std::string const& name) {
+    using invoker_type = StrategyInvoker<std::int64_t(std::int64_t), Storage>;
+
+    auto bias    = std::int64_t{ 3 };
+    auto scale   = Scale{ 2, 1, &bias };
+    auto invoker = invoker_type{};
+    if constexpr (std::is_same_v<Storage, strategy::PointerStorage>) {
+        invoker.SetStrategy(ScaleByTwo);
+    }
+    else {
+        invoker.SetStrategy(scale);
+    }
+
+    BENCHMARK(name + ", Invoke x1000") { return InvokeLoop(invoker); };
+    BENCHMARK(name + ", SetStrategy + Invoke") {
+        auto strategy = Scale{ 3, 2, &bias };
+        if constexpr (std::is_same_v<Storage, strategy::PointerStorage>) {
+            invoker.SetStrategy(ScaleByTwo);
+        }
+        else {
+            invoker.SetStrategy(strategy);
+        }
+        return invoker.Invoke(7);
+    };
+}
+
+TEST_CASE("strategy invoke", "[.][benchmark]") {
+    BenchmarkStrategy<strategy::FunctionStorage>("std::function");
+    BenchmarkStrategy<strategy::InplaceStorage<>>("inplace");
+    BenchmarkStrategy<strategy::RefStorage>("function ref");
+    BenchmarkStrategy<strategy::PointerStorage>("function pointer");
+}
+} // namespace
+
+namespace {
+constexpr auto kKernelSize = 1 << 20;
+
+TEST_CASE("cpu dispatch kernels", "[.][benchmark]") {
+    using strategy::CpuLevel;
+
+    auto values = std::vector<std::int32_t>(kKernelSize);
+    auto bytes  = std::vector<std::uint8_t>(kKernelSize);
+    for (auto i = 0; i < kKernelSize; ++i) {
+        values[i] = i % 1000 - 500;
+        bytes[i]  = static_cast<std::uint8_t>(i % 200);
+    }
+    // 要找的字节在最后
+    bytes.back() = 255;
+
+    for (auto level = 0; level <= static_cast<int>(strategy::DetectCpuLevel()); ++level) {
+        auto const cpu  = static_cast<CpuLevel>(level);
+        auto const name = std::string{ strategy::ToString(cpu) };
+        auto const sum  = strategy::kernels::Sum.Get(cpu);
+        auto const span = std::span<std::int32_t const>{ values };
+        BENCHMARK("sum, " + name) { return sum(span); };
+
+        auto const minmax = strategy::kernels::MinMax.Get(cpu);
+        BENCHMARK("minmax, " + name) { return minmax(span).max; };
+
+        auto const find = strategy::kernels::Find.Get(cpu);
+        BENCHMARK("find, " + name) { return find(bytes, 255); };
+    }
+}
+} // namespace
+
+namespace {
+constexpr auto kCommandsPerTick = 4096;
+
+struct Tick {};
+
+class MoveBy : public command::Command<Tick> {
+public:
+    MoveBy(std::int64_t& position, std::int64_t delta) : position_(&position), delta_(delta) {}
+    void Execute() override { *position_ += delta_; }
+
+private:
+    std::int64_t* position_;
+    std::int64_t delta_;
+};
+
+// 不继承Command，可以平凡复制
+struct PlainMoveBy {
+    std::int64_t* position;
+    std::int64_t delta;
+    void Execute() const { *position += delta; }
+};
+
+TEST_CASE("command buffer", "[.][benchmark]") {
+    auto position = std::int64_t{ 0 };
+
+    BENCHMARK("vector of unique_ptr, per tick") {
+        auto commands = std::vector<std::unique_ptr<command::Command<Tick>>>{};
+        for (auto i = 0; i < kCommandsPerTick; ++i) {
+            commands.push_back(std::make_unique<MoveBy>(position, i));
+        }
+        for (auto& command : commands) {
+            command->Execute();
+        }
+        return position;
+    };
+
+    auto buffer = command::CommandBuffer<Tick>{};
+    BENCHMARK("command buffer, reset per tick") {
+        buffer.Reset();
+        for (auto i = 0; i < kCommandsPerTick; ++i) {
+            buffer.Emplace<MoveBy>(position, i);
+        }
+        buffer.Execute();
+        return position;
+    };
+
+    auto plain = command::CommandBuffer<Tick>{};
+    BENCHMARK("command buffer of plain commands, reset per tick") {
+        plain.Reset();
+        for (auto i = 0; i < kCommandsPerTick; ++i) {
+            plain.Emplace<PlainMoveBy>(&position, i);
+        }
+        plain.Execute();
+        return position;
+    };
+}
+} // namespace
+
+namespace {
+// 每个命令做一点计算，只有少数命令写同一个资源
+class Simulate : public command::Command<Tick> {
+public:
+    explicit Simulate(std::uint64_t& state) : state_(&state) {}
+    void Execute() override {
+        auto value = *state_;
+        for (auto i = 0; i < 256; ++i) {
+            value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+        }
+        *state_ = value;
+    }
+
+private:
+    std::uint64_t* state_;
+};
+
+class TickList : public command::CommandList<Tick> {
+public:
+    TickList() = default;
+};
+
+class TickInvoker : public command::Invoker<Tick> {
+public:
+    TickInvoker() = default;
+};
+
+TEST_CASE("parallel command invoker", "[.][benchmark]") {
+    auto states = std::vector<std::uint64_t>(kCommandsPerTick);
+    auto shared = std::uint64_t{ 0 };
+    auto list   = TickList{};
+    auto write  = command::Access{ .reads = {}, .writes = { command::ResourceOf(shared) } };
+    for (auto i = 0; i < kCommandsPerTick; ++i) {
+        if (i % 64 == 0) {
+            list.Add(Simulate{ shared }, write);
+        }
+        else {
+            list.Add(Simulate{ states[i] });
+        }
+    }
+
+    auto sequential = TickInvoker{};
+    BENCHMARK("sequential invoker") {
+        sequential.Invoke(list);
+        return shared;
+    };
+
+    auto pool     = ThreadPool{};
+    auto parallel = command::ParallelInvoker<Tick>{ pool };
+    BENCHMARK("parallel invoker") {
+        parallel.Invoke(list);
+        return shared;
+    };
+}
+} // namespace
+
+namespace {
+constexpr auto kQueueCommands = 1 << 14;
+constexpr auto kQueueCapacity = 1024;
+constexpr auto kProducerBatch = 32;
+
+class Count : public command::Command<Tick> {
+public:
+    explicit Count(std::int64_t& total) : total_(&total) {}
+    void Execute() override { ++*total_; }
+
+private:
+    std::int64_t* total_;
+};
+
+// 记录从入队到执行经过的时间
+class Stamp : public command::Command<Tick> {
+public:
+    explicit Stamp(std::vector<std::chrono::nanoseconds>& samples)
+        : samples_(&samples), sent_(std::chrono::steady_clock::now()) {}
+    void Execute() override { samples_->push_back(std::chrono::steady_clock::now() - sent_); }
+
+private:
+    std::vector<std::chrono::nanoseconds>* samples_;
+    std::chrono::steady_clock::time_point sent_;
+};
+
+// 作为对照的加锁队列
+class LockedQueue {
+public:
+    void Push(std::function<void()> task) {
+        auto lock = std::lock_guard{ mutex_ };
+        tasks_.push_back(std::move(task));
+    }
+
+    int Drain() {
+        auto tasks = std::deque<std::function<void()>>{};
+        {
+            auto lock = std::lock_guard{ mutex_ };
+            tasks.swap(tasks_);
+        }
+        for (auto& task : tasks) {
+            task();
+        }
+        return static_cast<int>(tasks.size());
+    }
+
+private:
+    std::mutex mutex_;
+    std::deque<std::function<void()>> tasks_;
+};
+
+// 每个生产者线程入队kQueueCommands / producers个命令，当前线程作为消费者直到全部执行完
+template <typename Produce, typename Consume>
+void RunProducers(int producers, Produce produce, Consume consume) {
+    auto threads = std::vector<std::thread>{};
+    for (auto producer = 0; producer < producers; ++producer) {
+        threads.emplace_back([&produce, count = kQueueCommands / producers]() { produce(count); });
+    }
+    for (auto consumed = 0; consumed < kQueueCommands;) {
+        auto const count = static_cast<int>(consume());
+        if (count == 0) {
+            std::this_thread::yield();
+        }
+        consumed += count;
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+std::string Percentiles(std::vector<std::chrono::nanoseconds> samples) {
+    std::ranges::sort(samples);
+    auto at = [&](double fraction) {
+        auto const index = static_cast<std::size_t>(fraction * (samples.size() - 1));
+        return std::to_string(samples[index].count() / 1000) + "us";
+    };
+    return "p50 " + at(0.5) + ", p99 " + at(0.99) + ", max " + at(1.0);
+}
+
+TEST_CASE("command queue", "[.][benchmark]") {
+    for (auto producers : { 1, 4, 16, 64 }) {
+        auto const suffix = ", " + std::to_string(producers) + " producers";
+        auto total        = std::int64_t{ 0 };
+
+        auto locked = LockedQueue{};
+        BENCHMARK("locked deque" + suffix) {
+            RunProducers(
+                producers,
+                [&](int count) {
+                    for (auto i = 0; i < count; ++i) {
+                        locked.Push([&total]() { ++total; });
+                    }
+                },
+                [&]() { return locked.Drain(); }
+            );
+            return total;
+        };
+
+        auto queue = command::CommandQueue<Tick>{ kQueueCapacity };
+        BENCHMARK("lock-free queue" + suffix) {
+            RunProducers(
+                producers,
+                [&](int count) {
+                    for (auto i = 0; i < count; ++i) {
+                        queue.Push(Count{ total });
+                    }
+                },
+                [&]() { return queue.Drain(); }
+            );
+            return total;
+        };
+
+        BENCHMARK("lock-free queue, batched producers" + suffix) {
+            RunProducers(
+                producers,
+                [&](int count) {
+                    auto producer = command::CommandQueue<Tick>::Producer{ queue, kProducerBatch };
+                    for (auto i = 0; i < count; ++i) {
+                        producer.Add(Count{ total });
+                    }
+                },
+                [&]() { return queue.Drain(); }
+            );
+            return total;
+        };
+
+        // 尾延迟：入队到执行的时间
+        auto samples = std::vector<std::chrono::nanoseconds>{};
+        samples.reserve(kQueueCommands);
+        RunProducers(
+            producers,
+            [&](int count) {
+                for (auto i = 0; i < count; ++i) {
+                    locked.Push([stamp = Stamp{ samples }]() mutable { stamp.Execute(); });
+                }
+            },
+            [&]() { return locked.Drain(); }
+        );
+        WARN("locked deque latency" << suffix << ": " << Percentiles(samples));
+
+        samples.clear();
+        RunProducers(
+            producers,
+            [&](int count) {
+                for (auto i = 0; i < count; ++i) {
+                    queue.Push(Stamp{ samples });
+                }
+            },
+            [&]() { return queue.Drain(); }
+        );
+        WARN("lock-free queue latency" << suffix << ": " << Percentiles(samples));
+    }
+}
+} // namespace
+
+namespace {
+constexpr auto kDocumentSize = 1 << 14;
+constexpr auto kEdits        = 256;
+
+class Document : public memento::Originator<std::vector<int>> {
+public:
+    Document() { state_.resize(kDocumentSize); }
+
+    void Set(std::size_t index, int value) { state_[index] = value; }
+};
+
+class SetCell : public command::ReversibleCommand<Tick> {
+public:
+    SetCell(std::vector<int>& cells, std::size_t index, int value)
+        : cells_(&cells), index_(index), after_(value) {}
+
+    void Execute() override {
+        before_           = (*cells_)[index_];
+        (*cells_)[index_] = after_;
+    }
+    void Undo() override { (*cells_)[index_] = before_; }
+
+private:
+    std::vector<int>* cells_;
+    std::size_t index_;
+    int before_ = 0;
+    int after_;
+};
+
+std::size_t EditIndex(int edit) {
+    return static_cast<std::size_t>(edit) * 7919 % kDocumentSize;
+}
+
+TEST_CASE("undo history", "[.][benchmark]") {
+    // 每一步之前保存完整的快照
+    auto document  = Document{};
+    auto snapshots = std::vector<memento::Memento<std::vector<int>>>{};
+    BENCHMARK("memento snapshot per edit") {
+        for (auto edit = 0; edit < kEdits; ++edit) {
+            snapshots.push_back(document.Save());
+            document.Set(EditIndex(edit), edit);
+        }
+        while (!snapshots.empty()) {
+            document.Restore(snapshots.back());
+            snapshots.pop_back();
+        }
+        return snapshots.size();
+    };
+
+    // 只记录每个命令的增量
+    auto cells   = std::vector<int>(kDocumentSize);
+    auto history = command::History<Tick>{ 64 * 1024 };
+    BENCHMARK("delta history") {
+        for (auto edit = 0; edit < kEdits; ++edit) {
+            history.Execute(SetCell{ cells, EditIndex(edit), edit });
+        }
+        history.Undo(kEdits);
+        history.Clear();
+        return cells[0];
+    };
+
+    for (auto edit = 0; edit < kEdits; ++edit) {
+        history.Execute(SetCell{ cells, EditIndex(edit), edit });
+    }
+    auto const snapshot_bytes = std::size_t{ kEdits } * kDocumentSize * sizeof(int);
+    WARN(
+        kEdits << " edits: snapshots " << snapshot_bytes / 1024 << " KiB, history "
+               << history.Bytes() / 1024 << " KiB"
+    );
+}
+} // namespace
+
+namespace {
+constexpr auto kRequests = 4096;
+
+// 运行期链接的处理者，每个处理者自己决定处理还是转发
+class Approval : public Handler<Approval> {
+public:
+    virtual ~Approval() = default;
+    virtual int Handle(int days) = 0;
+
+protected:
+    int Forward(int days) { return next_ ? static_cast<Approval*>(next_)->Handle(days) : 0; }
+};
+
+template <int Limit>
+class LinkedApprover : public Approval {
+public:
+    int Handle(int days) override { return days < Limit ? Limit : Forward(days); }
+};
+
+template <int Limit>
+struct StaticApprover {
+    bool TryHandle(std::pair<int, int>& request) {
+        if (request.first >= Limit) {
+            return false;
+        }
+        request.second = Limit;
+        return true;
+    }
+};
+
+TEST_CASE("chain of responsibility", "[.][benchmark]") {
+    auto days   = std::vector<int>(kRequests);
+    auto random = std::mt19937{ 42 };
+    for (auto& day : days) {
+        day = std::uniform_int_distribution{ 0, 40 }(random);
+    }
+
+    auto first  = LinkedApprover<3>{};
+    auto second = LinkedApprover<7>{};
+    auto third  = LinkedApprover<15>{};
+    auto fourth = LinkedApprover<30>{};
+    first.SetNextHandler(second);
+    second.SetNextHandler(third);
+    third.SetNextHandler(fourth);
+    auto& linked = static_cast<Approval&>(first);
+    BENCHMARK("runtime linked chain") {
+        auto total = 0;
+        for (auto day : days) {
+            total += linked.Handle(day);
+        }
+        return total;
+    };
+
+    auto chain = StaticChain<
+        StaticApprover<3>,
+        StaticApprover<7>,
+        StaticApprover<15>,
+        StaticApprover<30>>{};
+    BENCHMARK("static chain") {
+        auto total = 0;
+        for (auto day : days) {
+            auto request = std::pair{ day, 0 };
+            chain.Handle(request);
+            total += request.second;
+        }
+        return total;
+    };
+}
+} // namespace
+
+namespace {
+constexpr auto kSteps = 4096;
+
+struct Link {};
+
+class Idle : public state::State<Link> {};
+class Opening : public state::State<Link> {};
+class Open : public state::State<Link> {};
+
+struct Dial {};
+struct Accept {};
+struct HangUp {};
+
+auto sessions = 0;
+
+struct IdleState {};
+struct OpeningState {};
+struct OpenState {
+    void OnEntry() noexcept { ++sessions; }
+};
+
+using LinkMachine = state::StateMachine<
+    meta::TypeList<IdleState, OpeningState, OpenState>,
+    meta::TypeList<
+        state::Transition<IdleState, Dial, OpeningState>,
+        state::Transition<OpeningState, Accept, OpenState>,
+        state::Transition<OpenState, HangUp, IdleState>>>;
+
+TEST_CASE("state machine", "[.][benchmark]") {
+    // 每次转移分配一个新状态，用dynamic_cast判断当前状态
+    auto context = state::Context<Link>{};
+    context.Set(Idle{});
+    BENCHMARK("context with dynamic_cast") {
+        auto opened = 0;
+        for (auto step = 0; step < kSteps; ++step) {
+            if (context.Castable<Idle>()) {
+                context.Set(Opening{});
+            }
+            else if (context.Castable<Opening>()) {
+                context.Set(Open{});
+                ++opened;
+            }
+            else if (context.Castable<Open>()) {
+                context.Set(Idle{});
+            }
+        }
+        return opened;
+    };
+
+    auto machine = LinkMachine{};
+    BENCHMARK("table-driven state machine") {
+        for (auto step = 0; step < kSteps; ++step) {
+            if (machine.Is<IdleState>()) {
+                machine.Dispatch(Dial{});
+            }
+            else if (machine.Is<OpeningState>()) {
+                machine.Dispatch(Accept{});
+            }
+            else {
+                machine.Dispatch(HangUp{});
+            }
+        }
+        return sessions;
+    };
+
+    // 事件不适用于当前状态时只查一次表
+    BENCHMARK("table-driven state machine, blind dispatch") {
+        for (auto step = 0; step < kSteps; ++step) {
+            machine.Dispatch(Dial{});
+            machine.Dispatch(Accept{});
+            machine.Dispatch(HangUp{});
+        }
+        return sessions;
+    };
+}
+} // namespace
@@ -1,15 +1,34 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <numeric>
+#include <ranges>
+#include <span>
+#include <sstream>
+#include <stop_token>
+#include <string>
 #include <string_view>
+#include <thread>
 #include <type_traits>
+#include <variant>
 #include <vector>
 
 // 如果不能运行，多半是跟Catch2有关
 #define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
 #include <catch.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
 #include <catch2/catch_test_macros.hpp>
 
+#include "cpu_dispatch.hpp"
 #include "pattern.hpp"
 #include "singleton.hpp"
 
@@ -46,6 +65,98 @@ TEST_CASE("simple factory pattern") {
         apple->eat();
         banana->eat();
     }
+
+    SECTION("pooled usage") {
+        class Fruit : public simplefactory::Product<Fruit> {
+        public:
+            explicit Fruit(int weight) : weight(weight) {}
+            int weight;
+        };
+
+        class Apple : public Fruit {
+        public:
+            explicit Apple(int weight) : Fruit(weight) {}
+        };
+
+        class PooledFruitFactory : public simplefactory::PooledSimpleFactory<Fruit> {
+        public:
+            PooledFruitFactory() = default;
+        };
+
+        auto factory{ PooledFruitFactory{} };
+        std::pmr::memory_resource* resource = &factory.GetResource();
+        REQUIRE(factory.GetAllocator().resource() == resource);
+
+        auto apple{ factory.Create<Apple>(150) };
+        REQUIRE(apple->weight == 150);
+        apple.reset();
+
+        // 每个线程一个不加锁的池
+        using LocalPool = std::pmr::unsynchronized_pool_resource;
+        class LocalFruitFactory : public simplefactory::PooledSimpleFactory<Fruit, LocalPool> {
+        public:
+            LocalFruitFactory() = default;
+        };
+
+        auto local_factory{ LocalFruitFactory{} };
+        auto apples = std::vector<std::shared_ptr<Apple>>{};
+        for (auto i = 0; i < 16; ++i) {
+            apples.push_back(local_factory.Create<Apple>(i));
+        }
+        REQUIRE(apples.back()->weight == 15);
+    }
+
+    SECTION("registry") {
+        class Fruit : public simplefactory::Product<Fruit> {
+        public:
+            virtual std::string_view name() const = 0;
+        };
+
+        class Apple : public Fruit {
+        public:
+            static constexpr std::string_view ProductName() { return "apple"; }
+            virtual std::string_view name() const override { return "apple"; }
+        };
+
+        class Banana : public Fruit {
+        public:
+            Banana() = default;
+            explicit Banana(int length) : length(length) {}
+            static constexpr std::string_view ProductName() { return "banana"; }
+            virtual std::string_view name() const override { return "banana"; }
+            int length = 0;
+        };
+
+        class Cherry : public Fruit {
+        public:
+            virtual std::string_view name() const override { return "cherry"; }
+        };
+
+        using Fruits = meta::TypeList<Apple, Banana, Cherry>;
+
+        class FruitRegistry : public simplefactory::Registry<Fruit, Fruits> {
+        public:
+            FruitRegistry() = default;
+        };
+
+        static_assert(FruitRegistry::Id("apple") == FruitRegistry::id_of<Apple>);
+        static_assert(FruitRegistry::Contains(FruitRegistry::id_of<Cherry>));
+        static_assert(!FruitRegistry::Contains(FruitRegistry::Id("durian")));
+
+        auto registry{ FruitRegistry{} };
+        REQUIRE(registry.Create("apple")->name() == "apple");
+        REQUIRE(registry.Create(FruitRegistry::Id("banana"))->name() == "banana");
+        REQUIRE(registry.Create(FruitRegistry::id_of<Cherry>)->name() == "cherry");
+        REQUIRE(registry.Create("durian") == nullptr);
+
+        // 只有Banana能用int构造
+        auto banana = registry.Create("banana", 20);
+        REQUIRE(std::static_pointer_cast<Banana>(banana)->length == 20);
+        REQUIRE(registry.Create("apple", 20) == nullptr);
+
+        // 编译期已知类型时仍然可以直接创建
+        REQUIRE(registry.Create<Apple>()->name() == "apple");
+    }
 }
 } // namespace
 
@@ -82,6 +193,79 @@ TEST_CASE("factory pattern") {
         auto fruit = factory.Create();
         fruit->eat();
     }
+
+    SECTION("pooled usage") {
+        struct Apple : public factory::Product<Apple> {
+            explicit Apple(int weight) : weight(weight) {}
+            int weight;
+        };
+
+        class AppleFactory : public factory::PooledFactory<Apple> {
+        public:
+            AppleFactory() = default;
+        };
+
+        auto factory{ AppleFactory{} };
+        auto apple = factory.Create(100);
+        REQUIRE(apple->weight == 100);
+    }
+
+    SECTION("batch usage") {
+        struct Apple : public factory::Product<Apple> {
+            explicit Apple(int weight) : weight(weight) {}
+            int weight;
+        };
+
+        class AppleFactory : public factory::Factory<Apple> {
+        public:
+            AppleFactory() = default;
+        };
+
+        auto factory{ AppleFactory{} };
+        auto apples = factory.CreateN(8, 120);
+        REQUIRE(apples.size() == 8);
+        REQUIRE(&apples[7] - &apples[0] == 7);
+
+        auto total = 0;
+        for (auto const& apple : apples) {
+            total += apple.weight;
+        }
+        REQUIRE(total == 8 * 120);
+
+        // 单个句柄让整批产品存活
+        auto third = apples.Share(2);
+        apples     = {};
+        REQUIRE(third->weight == 120);
+    }
+
+    SECTION("soa usage") {
+        struct Particle {
+            float x;
+            float y;
+            int id;
+        };
+
+        class ParticleFactory : public factory::Factory<Particle> {
+        public:
+            ParticleFactory() = default;
+        };
+
+        auto factory{ ParticleFactory{} };
+        auto particles = factory.CreateSoA<&Particle::x, &Particle::y>(100, 1.0f, 2.0f, 7);
+        REQUIRE(particles.size() == 100);
+
+        auto xs = particles.Column<0>();
+        REQUIRE(reinterpret_cast<std::uintptr_t>(xs.data()) % decltype(particles)::alignment == 0);
+        for (auto& x : xs) {
+            x += 1.0f;
+        }
+
+        particles.Store(3, Particle{ 0.0f, 5.0f, 3 });
+        REQUIRE(particles.Load(0).x == 2.0f);
+        REQUIRE(particles.Load(0).id == 7);
+        REQUIRE(particles.Load(3).y == 5.0f);
+        REQUIRE(particles.Column<1>()[3] == 5.0f);
+    }
 }
 } // namespace
 
@@ -131,6 +315,76 @@ TEST_CASE("builder pattern") {
         auto meal{ waiter.Construct(builder) };
         std::cout << meal->name << "\t" << meal->weight << std::endl;
     }
+
+    SECTION("inplace usage") {
+        struct Meal {
+            std::string_view name;
+            int weight = 0;
+        };
+
+        class ChildrenMealBuilder {
+        public:
+            using product_type = Meal;
+
+            constexpr void Build(Meal& product) const {
+                product.name   = "children meal";
+                product.weight = 200;
+            }
+        };
+
+        using Director = builder::Director;
+
+        constexpr auto builder = ChildrenMealBuilder{};
+        static_assert(builder::InplaceBuilder<ChildrenMealBuilder const>);
+        static_assert(Director::Make(builder).weight == 200);
+
+        auto meal = Director::Make(builder);
+        REQUIRE(meal.name == "children meal");
+
+        alignas(Meal) std::byte storage[sizeof(Meal)];
+        auto* placed = Director::ConstructAt(builder, reinterpret_cast<Meal*>(storage));
+        REQUIRE(placed->weight == 200);
+        std::destroy_at(placed);
+    }
+
+    SECTION("inplace failure") {
+        struct Order {
+            Order()             = default;
+            Order(Order const&) = delete;
+            ~Order() {
+                if (destroyed != nullptr) {
+                    ++*destroyed;
+                }
+            }
+
+            int* destroyed = nullptr;
+        };
+
+        // 构建到一半失败
+        class FailingBuilder {
+        public:
+            using product_type = Order;
+
+            explicit FailingBuilder(int& destroyed) : destroyed_(&destroyed) {}
+
+            void Build(Order& product) const {
+                product.destroyed = destroyed_;
+                throw std::runtime_error("out of stock");
+            }
+
+        private:
+            int* destroyed_;
+        };
+
+        auto destroyed = 0;
+        auto builder   = FailingBuilder{ destroyed };
+        alignas(Order) std::byte storage[sizeof(Order)];
+        REQUIRE_THROWS_AS(
+            builder::Director::ConstructAt(builder, reinterpret_cast<Order*>(storage)),
+            std::runtime_error
+        );
+        REQUIRE(destroyed == 1);
+    }
 }
 } // namespace
 
@@ -167,6 +421,57 @@ TEST_CASE("prototype") {
         auto apple2 = apple.Clone();
         auto apple3 = apple.Clone();
     }
+
+    SECTION("registry") {
+        class Config : public prototype::Clonable<Config> {
+        public:
+            Config() = default;
+            explicit Config(int level) : level(level) {}
+
+            int level = 0;
+            std::vector<int> weights = std::vector<int>(256, 1);
+        };
+
+        class ConfigRegistry : public prototype::Registry<Config> {
+        public:
+            ConfigRegistry() = default;
+        };
+
+        auto registry = ConfigRegistry{};
+        registry.Register("default", Config{ 3 });
+        REQUIRE(registry.Contains("default"));
+
+        // 克隆在写之前共享同一个对象
+        auto clone1 = registry.Clone("default");
+        auto clone2 = registry.Clone("default");
+        REQUIRE(&clone1.Read() == &clone2.Read());
+        REQUIRE(clone1->level == 3);
+
+        clone1.Write().level = 4;
+        REQUIRE(&clone1.Read() != &clone2.Read());
+        REQUIRE(clone1->level == 4);
+        REQUIRE(clone2->level == 3);
+        REQUIRE(registry.Clone("default")->level == 3);
+
+        // 自己的副本被复制之后再写也要复制，另一方随之变为独占
+        REQUIRE(clone2.Shared());
+        REQUIRE_FALSE(clone1.Shared());
+        auto* const written = &clone1.Write();
+        REQUIRE(&clone1.Write() == written);
+        auto copy = clone1;
+        REQUIRE(clone1.Shared());
+        copy.Write().level = 5;
+        REQUIRE(clone1->level == 4);
+        REQUIRE_FALSE(clone1.Shared());
+        REQUIRE(&clone1.Write() == written);
+
+        alignas(Config) std::byte storage[sizeof(Config)];
+        REQUIRE(registry.CloneSize("default") <= sizeof(storage));
+        auto* placed = registry.CloneInto("default", storage);
+        REQUIRE(placed->level == 3);
+        REQUIRE(placed->weights.size() == 256);
+        std::destroy_at(placed);
+    }
 }
 } // namespace
 
@@ -289,6 +594,192 @@ public:
 class ALeaf : public composite::Leaf<AComponent> {};
 
 class AComposite : public composite::Composite<AComponent> {};
+
+TEST_CASE("composite") {
+    SECTION("flat composite") {
+        auto tree = composite::FlatComposite<int>{};
+        auto root = tree.AddRoot(0);
+        auto a    = tree.Add(root, 1);
+        auto b    = tree.Add(root, 2);
+        auto c    = tree.Add(root, 3);
+        auto a1   = tree.Add(a, 11);
+        auto b1   = tree.Add(b, 21);
+        auto b11  = tree.Add(b1, 211);
+        REQUIRE(tree.size() == 7);
+
+        REQUIRE(tree.FirstChild(root) == a);
+        REQUIRE(tree.NextSibling(a) == b);
+        REQUIRE(tree.Parent(b11) == b1);
+
+        // 删除中间的子树，其余句柄仍然有效
+        tree.Remove(b);
+        REQUIRE(tree.size() == 4);
+        REQUIRE_FALSE(tree.Contains(b));
+        REQUIRE_FALSE(tree.Contains(b1));
+        REQUIRE_FALSE(tree.Contains(b11));
+        REQUIRE(tree.NextSibling(a) == c);
+        REQUIRE(tree.Get(c) == 3);
+        REQUIRE(tree.Get(a1) == 11);
+        REQUIRE(tree.Get(root) == 0);
+
+        auto sum = 0;
+        tree.ForEach([&sum](int value) { sum += value; });
+        REQUIRE(sum == 0 + 1 + 3 + 11);
+
+        // 槽位被复用时旧句柄失效
+        auto d = tree.Add(root, 4);
+        REQUIRE(d.index == b.index);
+        REQUIRE_FALSE(tree.Contains(b));
+        REQUIRE(tree.NextSibling(c) == d);
+
+        tree.Remove(root);
+        REQUIRE(tree.empty());
+
+        // 负载构造失败时树保持不变
+        struct Picky {
+            explicit Picky(int value) : value(value) {
+                if (value < 0) {
+                    throw std::invalid_argument("negative");
+                }
+            }
+            int value;
+        };
+
+        auto picky = composite::FlatComposite<Picky>{};
+        auto top   = picky.AddRoot(0);
+        auto first = picky.Add(top, 1);
+        REQUIRE_THROWS_AS(picky.Add(top, -1), std::invalid_argument);
+        REQUIRE(picky.size() == 2);
+        auto second = picky.Add(top, 2);
+        REQUIRE(picky.NextSibling(first) == second);
+        REQUIRE(picky.Parent(second) == top);
+        REQUIRE(picky.Get(second).value == 2);
+        picky.Remove(first);
+        REQUIRE(picky.FirstChild(top) == second);
+    }
+
+    SECTION("parallel reduce") {
+        struct Part {};
+
+        class Node : public composite::Composite<Part> {
+        public:
+            explicit Node(std::string name) : name(std::move(name)) {}
+            std::string name;
+        };
+
+        auto root = Node{ "r" };
+        for (auto i = 0; i < 4; ++i) {
+            auto child = std::make_shared<Node>(std::string(1, static_cast<char>('a' + i)));
+            for (auto j = 0; j < 3; ++j) {
+                child->Add(std::make_shared<Node>(std::to_string(j)));
+            }
+            root.Add(child);
+        }
+
+        auto pool  = ThreadPool{ 4 };
+        auto count = composite::Reduce(
+            pool, root, [](composite::Component<Part>&) { return 1; }, std::plus<>{}
+        );
+        REQUIRE(count == 1 + 4 + 4 * 3);
+
+        // 字符串拼接只满足结合律，结果应与先序遍历一致
+        auto names = composite::Reduce(
+            pool,
+            root,
+            [](composite::Component<Part>& node) { return static_cast<Node&>(node).name; },
+            std::plus<>{}
+        );
+        REQUIRE(names == "ra012b012c012d012");
+
+        auto visited = std::atomic<int>{ 0 };
+        composite::ForEach(pool, root, [&visited](composite::Component<Part>&) { ++visited; });
+        REQUIRE(visited == count);
+    }
+
+    SECTION("thread pool tasks") {
+        // 只能移动的小任务放在内部缓冲区，大的任务放在堆上
+        auto value = std::make_unique<int>(1);
+        auto small = MoveOnlyTask{ [value = std::move(value)]() { ++*value; } };
+        auto large = std::array<int, 32>{};
+        auto big   = MoveOnlyTask{ [&large, padding = std::array<int, 32>{}]() mutable {
+            padding.fill(1);
+            large = padding;
+        } };
+        auto moved = std::move(big);
+        REQUIRE_FALSE(big);
+        REQUIRE_THROWS_AS(big(), std::bad_function_call);
+        small();
+        moved();
+        REQUIRE(large[31] == 1);
+
+        auto pool    = ThreadPool{ 4 };
+        auto results = std::vector<int>(64);
+        {
+            auto group = TaskGroup{ pool };
+            for (auto i = 0; i < 64; ++i) {
+                group.Run([&results, i, owned = std::make_unique<int>(i)]() {
+                    results[i] = *owned * 2;
+                });
+            }
+            group.Wait();
+        }
+        for (auto i = 0; i < 64; ++i) {
+            REQUIRE(results[i] == i * 2);
+        }
+    }
+
+    SECTION("traversal") {
+        struct Part {};
+
+        class Node : public composite::Composite<Part> {
+        public:
+            explicit Node(char name) : name(name) {}
+            char name;
+        };
+
+        // a(b(e, f), c, d(g))
+        auto node = [](char name) { return std::make_shared<Node>(name); };
+        auto a    = Node{ 'a' };
+        auto b    = node('b');
+        auto d    = node('d');
+        b->Add(node('e'));
+        b->Add(node('f'));
+        d->Add(node('g'));
+        a.Add(b);
+        a.Add(node('c'));
+        a.Add(d);
+
+        auto name = [](composite::Component<Part>& part) { return static_cast<Node&>(part).name; };
+        auto collect = [&name](auto&& range) {
+            auto names = std::string{};
+            for (auto& part : range) {
+                names += name(part);
+            }
+            return names;
+        };
+        REQUIRE(collect(composite::PreOrder(a)) == "abefcdg");
+        REQUIRE(collect(composite::PostOrder(a)) == "efbcgda");
+        REQUIRE(collect(composite::BreadthFirst(a)) == "abcdefg");
+
+        auto leaves = composite::PostOrder(a) | std::views::filter([](auto& part) {
+                          return part.Children().empty();
+                      }) |
+                      std::views::transform(name);
+        REQUIRE(std::string(leaves.begin(), leaves.end()) == "efcg");
+
+        // 超过内联深度的链
+        auto chain = Node{ '0' };
+        auto tail  = static_cast<composite::Component<Part>*>(&chain);
+        for (auto i = 0; i < 100; ++i) {
+            auto next = node('x');
+            tail->Add(next);
+            tail = next.get();
+        }
+        REQUIRE(std::ranges::distance(composite::PreOrder(chain)) == 101);
+        REQUIRE(std::ranges::distance(composite::PostOrder(chain)) == 101);
+        REQUIRE(&*composite::PostOrder(chain).begin() == tail);
+    }
+}
 } // namespace
 
 namespace {
@@ -311,8 +802,107 @@ class ListNodeIterator
     ListNode<T>* current = nullptr;
 
 public:
+    ListNodeIterator() = default;
+    explicit ListNodeIterator(ListNode<T>* node) : current(node) {}
+
     T& dereference() const { return current->value; }
+    void increment() { current = current->next; }
+    bool equal(ListNodeIterator const& other) const { return current == other.current; }
 };
+
+// 钩子是私有的
+template <typename T>
+class ArrayIterator
+    : public iterator::Iterator<ArrayIterator<T>, T, std::contiguous_iterator_tag> {
+    friend class iterator::IteratorAccess;
+
+    T* current = nullptr;
+
+    T& dereference() const { return *current; }
+    void increment() { ++current; }
+    void decrement() { --current; }
+    bool equal(ArrayIterator const& other) const { return current == other.current; }
+    void advance(std::ptrdiff_t n) { current += n; }
+    std::ptrdiff_t distance_to(ArrayIterator const& other) const { return other.current - current; }
+
+public:
+    ArrayIterator() = default;
+    explicit ArrayIterator(T* pointer) : current(pointer) {}
+};
+
+static_assert(std::forward_iterator<ListNodeIterator<int>>);
+static_assert(!std::bidirectional_iterator<ListNodeIterator<int>>);
+static_assert(std::contiguous_iterator<ArrayIterator<int>>);
+static_assert(std::contiguous_iterator<ArrayIterator<int const>>);
+static_assert(sizeof(ArrayIterator<int>) == sizeof(int*));
+
+TEST_CASE("iterator") {
+    SECTION("forward iterator") {
+        auto* head = new ListNode<int>{ 1, new ListNode<int>{ 2, new ListNode<int>{ 3 } } };
+        auto sum   = std::accumulate(ListNodeIterator<int>{ head }, ListNodeIterator<int>{}, 0);
+        REQUIRE(sum == 6);
+        delete head;
+    }
+
+    SECTION("contiguous iterator") {
+        int values[] = { 5, 3, 4, 1, 2 };
+        auto first   = ArrayIterator<int>{ values };
+        auto last    = ArrayIterator<int>{ values + 5 };
+
+        std::ranges::sort(first, last);
+        REQUIRE(std::ranges::is_sorted(values));
+        REQUIRE(last - first == 5);
+        REQUIRE(first[2] == 3);
+        REQUIRE(*(last - 1) == 5);
+        REQUIRE(first < last);
+        REQUIRE(std::to_address(first + 1) == values + 1);
+
+        auto range = std::ranges::subrange(first, last);
+        auto even  = range | std::views::filter([](int value) { return value % 2 == 0; });
+        REQUIRE(std::ranges::distance(even) == 2);
+    }
+
+    SECTION("parallel") {
+        auto pool   = ThreadPool{ 4 };
+        auto values = std::vector<int>(1000);
+        std::iota(values.begin(), values.end(), 1);
+        auto array = std::ranges::subrange(
+            ArrayIterator<int>{ values.data() }, ArrayIterator<int>{ values.data() + values.size() }
+        );
+
+        auto split         = iterator::SplittableRange{ array };
+        auto [left, right] = split.Split();
+        REQUIRE(left.size() == 500);
+        REQUIRE(right.size() == 500);
+        REQUIRE(*right.begin() == 501);
+
+        iterator::ParallelForEach(pool, array, [](int& value) { value *= 2; }, 16);
+        REQUIRE(values[999] == 2000);
+
+        // 字符串拼接只满足结合律，结果应与顺序执行一致
+        auto digits = iterator::ParallelTransformReduce(
+            pool,
+            array | std::views::take(20),
+            std::string{},
+            std::plus<>{},
+            [](int value) { return std::to_string(value % 10); },
+            3
+        );
+        REQUIRE(digits == "24680246802468024680");
+
+        auto* head = new ListNode<int>{ 0 };
+        for (auto i = 1000; i > 0; --i) {
+            head->next = new ListNode<int>{ i, head->next };
+        }
+        auto list = std::ranges::subrange(ListNodeIterator<int>{ head }, ListNodeIterator<int>{});
+        iterator::ParallelForEach(pool, list, [](int& value) { ++value; }, 7);
+        auto sum = iterator::ParallelTransformReduce(
+            pool, list, std::int64_t{ 0 }, std::plus<>{}, [](int value) { return value; }, 7
+        );
+        REQUIRE(sum == 1000 * 1001 / 2 + 1001);
+        delete head;
+    }
+}
 } // namespace
 
 namespace {
@@ -353,39 +943,248 @@ TEST_CASE("proxy") {
         image.display();
         image.display();
     }
+
+    SECTION("concurrent usage") {
+        auto constructions = std::atomic<int>{ 0 };
+        auto proxy         = proxy::ConcurrentProxy([&constructions]() {
+            ++constructions;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            return std::make_unique<RealImage>();
+        });
+        REQUIRE(proxy.TryGet() == nullptr);
+
+        auto images  = std::vector<RealImage*>(8);
+        auto threads = std::vector<std::thread>{};
+        for (auto& image : images) {
+            threads.emplace_back([&proxy, &image]() { image = proxy.GetObject(); });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        REQUIRE(constructions == 1);
+        REQUIRE(proxy.TryGet() != nullptr);
+        for (auto* image : images) {
+            REQUIRE(image == proxy.TryGet());
+        }
+    }
+
+    SECTION("concurrent retry after failure") {
+        auto attempts = 0;
+        auto proxy    = proxy::ConcurrentProxy([&attempts]() -> std::unique_ptr<RealImage> {
+            if (++attempts == 1) {
+                throw std::runtime_error("load failed");
+            }
+            return std::make_unique<RealImage>();
+        });
+        REQUIRE_THROWS(proxy.GetObject());
+        REQUIRE(proxy.GetObject() != nullptr);
+        REQUIRE(attempts == 2);
+    }
+
+    SECTION("async usage") {
+        auto pool  = ThreadPool{ 1 };
+        auto proxy = proxy::AsyncProxy(pool, []() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            return std::make_unique<RealImage>();
+        });
+
+        proxy.Prefetch();
+        auto future = proxy.GetFuture();
+        auto* image = proxy.GetObject();
+        REQUIRE(image != nullptr);
+        REQUIRE(proxy.TryGet() == image);
+        REQUIRE(future.get() == image);
+    }
+
+    SECTION("async await") {
+        // 只用于测试的即时启动、不等待结果的协程
+        struct Detached {
+            struct promise_type {
+                Detached get_return_object() noexcept { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() noexcept {}
+                void unhandled_exception() noexcept { std::terminate(); }
+            };
+        };
+
+        auto pool    = ThreadPool{ 1 };
+        auto proxy   = proxy::AsyncProxy(pool, []() { return std::make_unique<RealImage>(); });
+        auto awaited = std::promise<RealImage*>{};
+        [](auto& proxy, auto& awaited) -> Detached {
+            awaited.set_value(co_await proxy);
+        }(proxy, awaited);
+        REQUIRE(awaited.get_future().get() == proxy.GetObject());
+    }
+
+    SECTION("caching usage") {
+        auto calls = std::atomic<int>{ 0 };
+        auto square = [&calls](int const& key) {
+            ++calls;
+            return key * key;
+        };
+        auto cache = proxy::CachingProxy<int, int, decltype(square)>(
+            square, proxy::CacheOptions{ .capacity = 2 }
+        );
+
+        REQUIRE(*cache.Get(3) == 9);
+        REQUIRE(*cache.Get(3) == 9);
+        REQUIRE(*cache.Get(4) == 16);
+        REQUIRE(calls == 2);
+
+        // 3最近被使用过，插入5时淘汰4
+        REQUIRE(*cache.Get(3) == 9);
+        REQUIRE(*cache.Get(5) == 25);
+        REQUIRE(cache.size() == 2);
+        REQUIRE(*cache.Get(3) == 9);
+        REQUIRE(calls == 3);
+        REQUIRE(*cache.Get(4) == 16);
+        REQUIRE(calls == 4);
+
+        auto const statistics = cache.GetStatistics();
+        REQUIRE(statistics.hits == 3);
+        REQUIRE(statistics.misses == 4);
+        REQUIRE(statistics.evictions == 2);
+    }
+
+    SECTION("caching byte budget") {
+        auto repeat = [](int const& key) {
+            return std::string(static_cast<std::size_t>(key), 'x');
+        };
+        auto sizer  = [](int const&, std::string const& value) { return value.size(); };
+        auto cache  = proxy::CachingProxy<int, std::string, decltype(repeat)>(
+            repeat, proxy::CacheOptions{ .byte_budget = 10 }, sizer
+        );
+
+        REQUIRE(cache.Get(4)->size() == 4);
+        REQUIRE(cache.Get(5)->size() == 5);
+        REQUIRE(cache.Bytes() == 9);
+
+        // 4+5+3超过预算，淘汰最久未使用的4
+        REQUIRE(cache.Get(3)->size() == 3);
+        REQUIRE(cache.size() == 2);
+        REQUIRE(cache.Bytes() == 8);
+
+        // 单个值超过预算时照常返回，但不留在缓存里
+        auto const large = cache.Get(11);
+        REQUIRE(large->size() == 11);
+        REQUIRE(cache.size() == 0);
+        REQUIRE(cache.Bytes() == 0);
+        REQUIRE(cache.GetStatistics().evictions == 4);
+    }
+
+    SECTION("caching expiration") {
+        static auto now = std::chrono::steady_clock::time_point{};
+        auto calls      = 0;
+        auto identity   = [&calls](int const& key) {
+            ++calls;
+            return key;
+        };
+        auto cache = proxy::CachingProxy<int, int, decltype(identity)>(
+            identity,
+            proxy::CacheOptions{
+                .ttl = std::chrono::seconds(10),
+                .now = []() { return now; },
+            }
+        );
+
+        REQUIRE(*cache.Get(1) == 1);
+        now += std::chrono::seconds(9);
+        REQUIRE(*cache.Get(1) == 1);
+        REQUIRE(calls == 1);
+
+        now += std::chrono::seconds(1);
+        REQUIRE(*cache.Get(1) == 1);
+        REQUIRE(calls == 2);
+
+        auto const statistics = cache.GetStatistics();
+        REQUIRE(statistics.hits == 1);
+        REQUIRE(statistics.misses == 2);
+        REQUIRE(statistics.expirations == 1);
+    }
+
+    SECTION("caching invalidation") {
+        auto calls    = std::atomic<int>{ 0 };
+        auto started  = std::promise<void>{};
+        auto release  = std::promise<void>{};
+        auto released = release.get_future().share();
+        // 第一次计算停在中间，返回的值带上第几次计算
+        auto slow = [&calls, &started, released](int const& key) {
+            auto const call = ++calls;
+            if (call == 1) {
+                started.set_value();
+                released.wait();
+            }
+            return key * 10 + call;
+        };
+        auto cache = proxy::CachingProxy<int, int, decltype(slow)>(slow);
+
+        auto stale  = 0;
+        auto thread = std::thread([&cache, &stale]() { stale = *cache.Get(1); });
+        started.get_future().wait();
+
+        // 失效之后不再等待进行中的计算
+        cache.Invalidate(1);
+        REQUIRE(*cache.Get(1) == 12);
+
+        release.set_value();
+        thread.join();
+        REQUIRE(stale == 11);
+
+        // 过时的结果没有覆盖新的值
+        REQUIRE(*cache.Get(1) == 12);
+        REQUIRE(calls == 2);
+        REQUIRE(cache.size() == 1);
+    }
+
+    SECTION("caching stampede") {
+        auto calls = std::atomic<int>{ 0 };
+        auto slow  = [&calls](int const& key) {
+            ++calls;
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            return key + 1;
+        };
+        auto cache = proxy::CachingProxy<int, int, decltype(slow)>(slow);
+
+        auto results = std::vector<int>(8);
+        auto threads = std::vector<std::thread>{};
+        for (auto& result : results) {
+            threads.emplace_back([&cache, &result]() { result = *cache.Get(41); });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        REQUIRE(calls == 1);
+        REQUIRE(std::count(results.begin(), results.end(), 42) == 8);
+
+        // 晚到的线程可能直接命中
+        auto const statistics = cache.GetStatistics();
+        REQUIRE(statistics.misses - statistics.coalesced == 1);
+        REQUIRE(statistics.hits + statistics.coalesced == 7);
+    }
 }
 } // namespace
 
 namespace {
-struct ComputerPart {};
-
-class Cpu : public visitor::Element<ComputerPart> {
-public:
+struct Cpu {
     int price = 300;
 };
 
-class Memory : public visitor::Element<ComputerPart> {
-public:
-    int price = 300;
+struct Memory {
+    int price = 200;
+    int size  = 16;
 };
 
 struct Computer {
-    std::vector<visitor::Element<ComputerPart>> parts;
-};
-
-class ComputerPartVisitor : public visitor::Visitor<ComputerPart> {
-public:
-    ComputerPartVisitor() = default;
-
-    virtual void visit(Cpu cpu)       = 0;
-    virtual void visit(Memory memory) = 0;
+    visitor::ElementSet<Cpu, Memory> parts;
 };
 
-class PriceCalculator final : public ComputerPartVisitor {
+class PriceCalculator {
 public:
-    void visit(Cpu cpu) override { total_ += cpu.price; }
+    void operator()(Cpu const& cpu) { total_ += cpu.price; }
 
-    void visit(Memory memory) override { total_ += memory.price; }
+    void operator()(Memory const& memory) { total_ += memory.price; }
 
     int get_totol_price() const { return total_; }
 
@@ -394,7 +1193,68 @@ private:
 };
 
 TEST_CASE("visitor") {
-    SECTION("normal usage") { auto computer{ Computer{} }; }
+    SECTION("normal usage") {
+        auto computer{ Computer{} };
+        computer.parts.Add<Cpu>();
+        computer.parts.Add<Memory>().size = 32;
+        computer.parts.Add<Memory>();
+
+        auto calculator = PriceCalculator{};
+        computer.parts.Accept(calculator);
+        REQUIRE(calculator.get_totol_price() == 700);
+    }
+
+    SECTION("overloaded usage") {
+        auto part = std::variant<Cpu, Memory>{ Memory{} };
+
+        // 返回类型由各个重载推导
+        auto name = visitor::Accept(
+            part,
+            visitor::Overloaded{
+                [](Cpu const&) { return "cpu"; },
+                [](Memory const&) { return std::string_view{ "memory" }; },
+            }
+        );
+        static_assert(std::is_same_v<decltype(name), std::string_view>);
+        REQUIRE(name == "memory");
+
+        visitor::Accept(part, [](auto& element) { element.price = 100; });
+        REQUIRE(std::get<Memory>(part).price == 100);
+    }
+
+    SECTION("bucket usage") {
+        auto parts = visitor::BucketSet<Cpu, Memory>{};
+        parts.Add<Memory>();
+        parts.Add<Cpu>();
+        parts.Add<Memory>(100, 8);
+        REQUIRE(parts.size() == 3);
+        REQUIRE(parts.Get<Memory>().size() == 2);
+
+        auto calculator = PriceCalculator{};
+        parts.VisitAll(calculator);
+        REQUIRE(calculator.get_totol_price() == 600);
+
+        // 泛型的visitor也能用span调用，VisitAll仍然逐个元素访问
+        auto total = 0;
+        parts.VisitAll([&](auto const& part) { total += part.price; });
+        REQUIRE(total == 600);
+
+        // VisitSpans时接受span的重载对整个桶只调用一次
+        auto memory_calls = 0;
+        auto total_size   = 0;
+        parts.VisitSpans(visitor::Overloaded{
+            [](Cpu& cpu) { cpu.price /= 2; },
+            [&](std::span<Memory const> memories) {
+                ++memory_calls;
+                for (auto const& memory : memories) {
+                    total_size += memory.size;
+                }
+            },
+        });
+        REQUIRE(memory_calls == 1);
+        REQUIRE(total_size == 24);
+        REQUIRE(parts.Get<Cpu>()[0].price == 150);
+    }
 }
 } // namespace
 
@@ -413,12 +1273,204 @@ private:
     StrategyInvoker<void()> invoker_;
 };
 
+int Twice(int value) { return value * 2; }
+
 TEST_CASE("strategy") {
     SECTION("normal usage") {
         auto sorter{ Sorter{} };
         sorter.set_function([]() {});
         sorter.sort();
     }
+
+    SECTION("storage policies") {
+        auto offset = 10;
+        auto add    = [&offset](int value) { return value + offset; };
+
+        auto function = StrategyInvoker<int(int)>{};
+        function.SetStrategy(add);
+        REQUIRE(function.Invoke(1) == 11);
+
+        auto inplace = StrategyInvoker<int(int), strategy::InplaceStorage<16>>{};
+        REQUIRE_THROWS_AS(inplace.Invoke(1), std::bad_function_call);
+        inplace.SetStrategy(add);
+        REQUIRE(inplace.Invoke(2) == 12);
+        inplace.SetStrategy([a = 1, b = 2](int value) { return value + a + b; });
+        REQUIRE(inplace.Invoke(2) == 5);
+
+        auto ref = StrategyInvoker<int(int), strategy::RefStorage>{};
+        ref.SetStrategy(add);
+        offset = 20;
+        REQUIRE(ref.Invoke(3) == 23);
+        ref.SetStrategy(Twice);
+        REQUIRE(ref.Invoke(3) == 6);
+
+        auto pointer = StrategyInvoker<int(int), strategy::PointerStorage>{};
+        pointer.SetStrategy(Twice);
+        REQUIRE(pointer.Invoke(4) == 8);
+        pointer.SetStrategy([](int value) { return -value; });
+        REQUIRE(pointer.Invoke(4) == -4);
+    }
+
+    SECTION("empty strategy") {
+        auto function = StrategyInvoker<int(int)>{};
+        auto inplace  = StrategyInvoker<int(int), strategy::InplaceStorage<16>>{};
+        auto ref      = StrategyInvoker<int(int), strategy::RefStorage>{};
+        auto pointer  = StrategyInvoker<int(int), strategy::PointerStorage>{};
+        REQUIRE_THROWS_AS(function.Invoke(1), std::bad_function_call);
+        REQUIRE_THROWS_AS(inplace.Invoke(1), std::bad_function_call);
+        REQUIRE_THROWS_AS(ref.Invoke(1), std::bad_function_call);
+        REQUIRE_THROWS_AS(pointer.Invoke(1), std::bad_function_call);
+    }
+
+    SECTION("cpu dispatch") {
+        using strategy::CpuLevel;
+
+        REQUIRE(strategy::ParseCpuLevel("avx2") == CpuLevel::Avx2);
+        REQUIRE_FALSE(strategy::ParseCpuLevel("neon"));
+        REQUIRE(strategy::LimitCpuLevel(CpuLevel::Avx512, "sse4.2") == CpuLevel::Sse42);
+        REQUIRE(strategy::LimitCpuLevel(CpuLevel::Sse42, "avx512") == CpuLevel::Sse42);
+        REQUIRE(strategy::DetectCpuLevel() <= strategy::DetectHardwareCpuLevel());
+
+        // 长度覆盖各个向量宽度的尾部
+        auto values = std::vector<std::int32_t>(1000);
+        auto bytes  = std::vector<std::uint8_t>(1000);
+        for (auto i = 0; i < 1000; ++i) {
+            values[i] = (i * 7919) % 2001 - 1000;
+            bytes[i]  = static_cast<std::uint8_t>(i % 200);
+        }
+        values[613] = std::numeric_limits<std::int32_t>::max();
+        values[977] = std::numeric_limits<std::int32_t>::min();
+        bytes[777]  = 255;
+
+        for (auto level = 0; level <= static_cast<int>(strategy::DetectCpuLevel()); ++level) {
+            auto const cpu = static_cast<CpuLevel>(level);
+            for (auto size : { 0, 1, 15, 16, 17, 63, 64, 65, 1000 }) {
+                auto const part = std::span{ values }.first(size);
+                REQUIRE(
+                    strategy::kernels::Sum.Get(cpu)(part) ==
+                    strategy::kernels::Sum.Get(CpuLevel::Scalar)(part)
+                );
+                auto const minmax = strategy::kernels::MinMax.Get(cpu)(part);
+                auto const expect = strategy::kernels::MinMax.Get(CpuLevel::Scalar)(part);
+                REQUIRE(minmax.min == expect.min);
+                REQUIRE(minmax.max == expect.max);
+            }
+            for (auto value : { 0, 5, 199, 255, 254 }) {
+                auto const needle = static_cast<std::uint8_t>(value);
+                REQUIRE(
+                    strategy::kernels::Find.Get(cpu)(bytes, needle) ==
+                    strategy::kernels::Find.Get(CpuLevel::Scalar)(bytes, needle)
+                );
+            }
+        }
+        REQUIRE(strategy::kernels::Find(bytes, 255) == 777);
+        REQUIRE(strategy::kernels::Find(bytes, 254) == bytes.size());
+
+        // 解析之后就是普通的函数指针
+        auto invoker = StrategyInvoker<
+            std::int64_t(std::span<std::int32_t const>),
+            strategy::PointerStorage>{};
+        invoker.SetStrategy(strategy::kernels::Sum.Get());
+        REQUIRE(invoker.Invoke(values) == std::accumulate(values.begin(), values.end(), 0LL));
+    }
+
+    SECTION("adaptive usage") {
+        // 候选只推进假的时钟，计时结果是确定的
+        static auto now = std::chrono::steady_clock::time_point{};
+        // 小输入时fast更快，大输入时slow的常数开销被摊薄后反而更快
+        auto make = [](std::chrono::microseconds small, std::chrono::microseconds large) {
+            return [small, large](std::size_t size) {
+                now += size < 100 ? small : large;
+                return size;
+            };
+        };
+        auto const quick    = std::chrono::microseconds{ 1000 };
+        auto const sluggish = std::chrono::microseconds{ 5000 };
+
+        auto options = strategy::AdaptiveOptions{
+            .warmup = 3,
+            .now    = []() { return now; },
+        };
+        auto bucket   = [](std::size_t size) { return strategy::Log2Bucket(size); };
+        auto adaptive = strategy::AdaptiveStrategy<std::size_t(std::size_t)>{ bucket, options };
+        adaptive.Add("fast", make(quick, sluggish));
+        adaptive.Add("slow", make(sluggish, quick));
+
+        for (auto i = 0; i < 6; ++i) {
+            REQUIRE(adaptive.Invoke(10) == 10);
+            REQUIRE(adaptive.Invoke(1000) == 1000);
+        }
+        REQUIRE(adaptive.Winner(strategy::Log2Bucket(10)) == "fast");
+        REQUIRE(adaptive.Winner(strategy::Log2Bucket(1000)) == "slow");
+        REQUIRE_FALSE(adaptive.Winner(0));
+        REQUIRE(adaptive.Decisions().size() == 2);
+
+        // 重启后直接加载决策表
+        auto table = std::stringstream{};
+        adaptive.Save(table);
+        auto restarted = strategy::AdaptiveStrategy<std::size_t(std::size_t)>{ bucket, options };
+        restarted.Add("slow", make(sluggish, quick));
+        restarted.Add("fast", make(quick, sluggish));
+        restarted.Load(table);
+        REQUIRE(restarted.Winner(strategy::Log2Bucket(10)) == "fast");
+        REQUIRE(restarted.Winner(strategy::Log2Bucket(1000)) == "slow");
+
+        // 格式错误时前面合法的行也不生效
+        auto broken = std::stringstream{ "4 slow\nfour slow\n" };
+        REQUIRE_THROWS_AS(restarted.Load(broken), std::runtime_error);
+        REQUIRE(restarted.Winner(strategy::Log2Bucket(10)) == "fast");
+        auto truncated = std::stringstream{ "4 slow\n7" };
+        REQUIRE_THROWS_AS(restarted.Load(truncated), std::runtime_error);
+        REQUIRE(restarted.Winner(strategy::Log2Bucket(10)) == "fast");
+
+        // 可以交给StrategyInvoker使用
+        auto invoker = StrategyInvoker<std::size_t(std::size_t), strategy::RefStorage>{};
+        invoker.SetStrategy(restarted);
+        REQUIRE(invoker.Invoke(1000) == 1000);
+    }
+
+    SECTION("adaptive exploration") {
+        static auto now = std::chrono::steady_clock::time_point{};
+        auto first      = std::chrono::microseconds{ 1000 };
+        auto second     = std::chrono::microseconds{ 5000 };
+
+        // epsilon为1时每次调用都计时，耗时变化之后切换到新的最快候选
+        auto options = strategy::AdaptiveOptions{
+            .warmup  = 3,
+            .epsilon = 1.0,
+            .now     = []() { return now; },
+        };
+        auto adaptive = strategy::AdaptiveStrategy<void()>{ []() { return 0; }, options };
+        adaptive.Add("first", [&first]() { now += first; });
+        adaptive.Add("second", [&second]() { now += second; });
+
+        for (auto i = 0; i < 6; ++i) {
+            adaptive();
+        }
+        REQUIRE(adaptive.Winner(0) == "first");
+
+        std::swap(first, second);
+        for (auto i = 0; i < 200; ++i) {
+            adaptive();
+        }
+        REQUIRE(adaptive.Winner(0) == "second");
+    }
+
+    SECTION("inplace function") {
+        auto counter = std::make_shared<int>(0);
+        auto first   = strategy::InplaceFunction<void()>{ [counter]() { ++*counter; } };
+        auto second  = first;
+        REQUIRE(counter.use_count() == 3);
+
+        auto third = std::move(first);
+        REQUIRE_FALSE(first);
+        second();
+        third();
+        REQUIRE(*counter == 2);
+
+        third = nullptr;
+        REQUIRE(counter.use_count() == 2);
+    }
 }
 } // namespace
 
@@ -461,6 +1513,493 @@ TEST_CASE("command") {
         invoker.Invoke(list1);
         invoker.Invoke(list2);
     }
+
+    SECTION("command buffer") {
+        class Append : public command::Command<AbsCommand> {
+        public:
+            Append(std::string& log, char tag) : log_(&log), tag_(tag) {}
+            void Execute() override { *log_ += tag_; }
+
+        private:
+            std::string* log_;
+            char tag_;
+        };
+
+        // 只能移动，并且需要析构
+        class AppendOwned : public command::Command<AbsCommand> {
+        public:
+            AppendOwned(std::string& log, std::unique_ptr<std::string> text)
+                : log_(&log), text_(std::move(text)) {}
+            void Execute() override { *log_ += *text_; }
+
+        private:
+            std::string* log_;
+            std::unique_ptr<std::string> text_;
+        };
+
+        auto log    = std::string{};
+        auto buffer = command::CommandBuffer<AbsCommand>{};
+        for (auto i = 0; i < 100; ++i) {
+            buffer.Emplace<Append>(log, static_cast<char>('a' + i % 26));
+        }
+        buffer.Add(AppendOwned{ log, std::make_unique<std::string>("!") });
+        buffer.Add(ConCommandB{});
+        REQUIRE(buffer.size() == 102);
+
+        buffer.Execute();
+        REQUIRE(log.size() == 101);
+        REQUIRE(log.substr(0, 3) == "abc");
+        REQUIRE(log.back() == '!');
+
+        // 复用同一块内存
+        auto const capacity = buffer.Capacity();
+        buffer.Reset();
+        REQUIRE(buffer.empty());
+        buffer.Emplace<Append>(log, 'z');
+        buffer.Execute();
+        REQUIRE(log.back() == 'z');
+        REQUIRE(buffer.Capacity() == capacity);
+
+        auto invoker = Invoker{};
+        invoker.Invoke(buffer);
+        REQUIRE(log.substr(log.size() - 2) == "zz");
+        REQUIRE_FALSE(buffer.Trivial());
+    }
+
+    SECTION("plain command buffer") {
+        // 不继承Command，可以平凡复制
+        struct Add {
+            int* total;
+            int value;
+            void Execute() const { *total += value; }
+        };
+        static_assert(std::is_trivially_copyable_v<Add>);
+
+        auto total  = 0;
+        auto buffer = command::CommandBuffer<AbsCommand>{};
+        for (auto i = 1; i <= 100; ++i) {
+            buffer.Add(Add{ &total, i });
+        }
+        REQUIRE(buffer.Trivial());
+        buffer.Execute();
+        REQUIRE(total == 5050);
+
+        buffer.Reset();
+        REQUIRE(buffer.empty());
+        buffer.Emplace<Add>(&total, -50);
+        buffer.Execute();
+        REQUIRE(total == 5000);
+
+        // 混入多态的命令之后，Reset需要逐个析构
+        buffer.Add(ConCommandB{});
+        REQUIRE_FALSE(buffer.Trivial());
+        buffer.Reset();
+        REQUIRE(buffer.Trivial());
+    }
+
+    SECTION("command queue") {
+        // 记录是哪个生产者的第几个命令，用来检查每个生产者的命令保持入队顺序
+        class Record : public command::Command<AbsCommand> {
+        public:
+            Record(std::vector<std::pair<int, int>>& log, int producer, int index)
+                : log_(&log), producer_(producer), index_(index) {}
+            void Execute() override { log_->emplace_back(producer_, index_); }
+
+        private:
+            std::vector<std::pair<int, int>>* log_;
+            int producer_;
+            int index_;
+        };
+
+        class Hold : public command::Command<AbsCommand> {
+        public:
+            explicit Hold(std::shared_ptr<int> value) : value_(std::move(value)) {}
+            void Execute() override { ++*value_; }
+
+        private:
+            std::shared_ptr<int> value_;
+        };
+
+        SECTION("bounded") {
+            auto value = std::make_shared<int>(0);
+            {
+                auto queue = command::CommandQueue<AbsCommand>{ 3 };
+                REQUIRE(queue.Capacity() == 4);
+                for (auto i = 0; i < 4; ++i) {
+                    REQUIRE(queue.TryPush(Hold{ value }));
+                }
+                auto extra = Hold{ value };
+                REQUIRE_FALSE(queue.TryPush(std::move(extra)));
+                REQUIRE(value.use_count() == 6);
+
+                auto invoker = Invoker{};
+                REQUIRE(queue.Drain(1) == 1);
+                REQUIRE(queue.size() == 3);
+                REQUIRE(queue.TryPush(std::move(extra)));
+                invoker.Invoke(queue);
+                REQUIRE(queue.empty());
+                REQUIRE(*value == 5);
+
+                // 没有执行的命令随队列析构
+                queue.Push(Hold{ value });
+                REQUIRE(value.use_count() == 2);
+            }
+            REQUIRE(value.use_count() == 1);
+        }
+
+        SECTION("producers") {
+            constexpr auto kProducers = 4;
+            constexpr auto kCommands  = 2000;
+
+            auto log     = std::vector<std::pair<int, int>>{};
+            auto queue   = command::CommandQueue<AbsCommand>{ 64 };
+            auto done    = std::atomic<int>{ 0 };
+            auto threads = std::vector<std::thread>{};
+            for (auto producer = 0; producer < kProducers; ++producer) {
+                threads.emplace_back([&, producer]() {
+                    // 一半的生产者逐个入队，另一半成批入队
+                    if (producer % 2 == 0) {
+                        for (auto index = 0; index < kCommands; ++index) {
+                            queue.Push(Record{ log, producer, index });
+                        }
+                    }
+                    else {
+                        auto batch = command::CommandQueue<AbsCommand>::Producer{ queue, 16 };
+                        for (auto index = 0; index < kCommands; ++index) {
+                            batch.Add(Record{ log, producer, index });
+                        }
+                    }
+                    done.fetch_add(1, std::memory_order_release);
+                });
+            }
+
+            auto buffer = command::CommandBuffer<AbsCommand>{};
+            while (done.load(std::memory_order_acquire) != kProducers || !queue.empty()) {
+                if (queue.Drain(100) == 0 && queue.DrainInto(buffer, 100) == 0) {
+                    std::this_thread::yield();
+                }
+                buffer.Execute();
+                buffer.Reset();
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            queue.Drain();
+
+            REQUIRE(log.size() == kProducers * kCommands);
+            auto next    = std::vector<int>(kProducers);
+            auto ordered = std::ranges::all_of(log, [&](auto const& record) {
+                return record.second == next[record.first]++;
+            });
+            REQUIRE(ordered);
+        }
+    }
+
+    SECTION("undo history") {
+        // 只记录修改前后的值
+        class SetValue : public command::ReversibleCommand<AbsCommand> {
+        public:
+            SetValue(std::vector<int>& values, std::size_t index, int value)
+                : values_(&values), index_(index), after_(value) {}
+
+            void Execute() override {
+                before_            = (*values_)[index_];
+                (*values_)[index_] = after_;
+            }
+            void Undo() override { (*values_)[index_] = before_; }
+
+            // 连续修改同一个位置时保留最早的旧值
+            bool Merge(SetValue const& next) {
+                if (next.values_ != values_ || next.index_ != index_) {
+                    return false;
+                }
+                after_ = next.after_;
+                return true;
+            }
+
+        private:
+            std::vector<int>* values_;
+            std::size_t index_;
+            int before_ = 0;
+            int after_;
+        };
+
+        auto values  = std::vector<int>(4);
+        auto history = command::History<AbsCommand>{ 1024 };
+        history.Execute(SetValue{ values, 0, 1 });
+        history.Execute(SetValue{ values, 0, 2 });
+        history.Execute(SetValue{ values, 0, 3 });
+        history.Execute(SetValue{ values, 1, 4 });
+        history.Execute(SetValue{ values, 2, 5 });
+        REQUIRE(values == std::vector{ 3, 4, 5, 0 });
+        REQUIRE(history.UndoCount() == 3);
+
+        REQUIRE(history.Undo(2) == 2);
+        REQUIRE(values == std::vector{ 3, 0, 0, 0 });
+        REQUIRE(history.Undo(5) == 1);
+        REQUIRE(values == std::vector{ 0, 0, 0, 0 });
+        REQUIRE(history.Redo(2) == 2);
+        REQUIRE(values == std::vector{ 3, 4, 0, 0 });
+        REQUIRE(history.RedoCount() == 1);
+
+        // 新命令丢弃可以重做的记录
+        history.Execute(SetValue{ values, 3, 6 });
+        REQUIRE(history.RedoCount() == 0);
+        REQUIRE(history.Redo() == 0);
+        REQUIRE(history.UndoCount() == 3);
+
+        // 超过预算时丢弃最早的记录
+        auto small = command::History<AbsCommand>{ 4 * sizeof(SetValue) };
+        for (auto i = 0; i < 10; ++i) {
+            small.Execute(SetValue{ values, static_cast<std::size_t>(i % 2), i });
+        }
+        REQUIRE(small.Bytes() <= small.Budget());
+        REQUIRE(small.UndoCount() <= 4);
+        // 撤销全部保留的记录，回到最早保留的那条命令之前
+        auto const first = 10 - static_cast<int>(small.UndoCount());
+        REQUIRE(small.Undo(10) == static_cast<std::size_t>(10 - first));
+        REQUIRE(values[first % 2] == first - 2);
+        REQUIRE(values[1 - first % 2] == first - 1);
+    }
+
+    SECTION("async invoker") {
+        struct Counters {
+            std::atomic<int> started{ 0 };
+            std::atomic<int> active{ 0 };
+            std::atomic<int> peak{ 0 };
+            std::atomic<int> finished{ 0 };
+        };
+
+        class Wait : public command::AsyncCommand<AbsCommand> {
+        public:
+            Wait(Counters& counters, std::chrono::milliseconds duration)
+                : counters_(&counters), duration_(duration) {}
+
+            command::Task ExecuteAsync(command::AsyncContext context) override {
+                ++counters_->started;
+                auto const active = ++counters_->active;
+                auto peak         = counters_->peak.load();
+                while (active > peak && !counters_->peak.compare_exchange_weak(peak, active)) {}
+
+                auto const completed = co_await context.Delay(duration_);
+                --counters_->active;
+                if (completed) {
+                    ++counters_->finished;
+                }
+            }
+
+        private:
+            Counters* counters_;
+            std::chrono::milliseconds duration_;
+        };
+
+        class Fail : public command::AsyncCommand<AbsCommand> {
+        public:
+            command::Task ExecuteAsync(command::AsyncContext context) override {
+                co_await context.Delay(std::chrono::milliseconds(1));
+                throw std::runtime_error("failed");
+            }
+        };
+
+        class AsyncList : public command::AsyncCommandList<AbsCommand> {
+        public:
+            AsyncList() = default;
+        };
+
+        // 只有一个线程，等待中的命令不占用它
+        auto pool     = ThreadPool{ 1 };
+        auto invoker  = command::AsyncInvoker<AbsCommand>{ pool, 3 };
+        auto counters = Counters{};
+        auto list     = AsyncList{};
+        for (auto i = 0; i < 9; ++i) {
+            list.Add(Wait{ counters, std::chrono::milliseconds(20) });
+        }
+        command::SyncWait(invoker.Invoke(list));
+        REQUIRE(counters.finished == 9);
+        REQUIRE(counters.peak == 3);
+
+        // 取消时正在等待的命令提前恢复，还没开始的命令不再执行
+        auto cancelled = Counters{};
+        list.Clear();
+        for (auto i = 0; i < 9; ++i) {
+            list.Add(Wait{ cancelled, std::chrono::seconds(10) });
+        }
+        auto source  = std::stop_source{};
+        auto stopper = std::jthread{ [&source]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            source.request_stop();
+        } };
+        auto const start = std::chrono::steady_clock::now();
+        command::SyncWait(invoker.Invoke(list, source.get_token()));
+        REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+        REQUIRE(cancelled.started == 3);
+        REQUIRE(cancelled.finished == 0);
+
+        list.Clear();
+        list.Add(Wait{ counters, std::chrono::milliseconds(1) });
+        list.Add(Fail{});
+        REQUIRE_THROWS_AS(command::SyncWait(invoker.Invoke(list)), std::runtime_error);
+    }
+
+    SECTION("parallel invoker") {
+        // 把value的当前值追加到history中，用来检查执行顺序
+        class Step : public command::Command<AbsCommand> {
+        public:
+            Step(int& value, int delta, std::vector<int>* history = nullptr)
+                : value_(&value), delta_(delta), history_(history) {}
+            void Execute() override {
+                *value_ += delta_;
+                if (history_ != nullptr) {
+                    history_->push_back(*value_);
+                }
+            }
+
+        private:
+            int* value_;
+            int delta_;
+            std::vector<int>* history_;
+        };
+
+        class StepList : public command::CommandList<AbsCommand> {
+        public:
+            StepList() = default;
+        };
+
+        auto pool    = ThreadPool{ 4 };
+        auto invoker = command::ParallelInvoker<AbsCommand>{ pool };
+
+        auto counters = std::vector<int>(64);
+        auto shared   = 0;
+        auto history  = std::vector<int>{};
+        auto list     = StepList{};
+        for (auto& counter : counters) {
+            list.Add(Step{ counter, 1 });
+        }
+        // 写同一个资源的命令按顺序执行
+        auto const resource = command::ResourceOf(shared);
+        for (auto i = 1; i <= 10; ++i) {
+            list.Add(Step{ shared, i, &history }, { .reads = {}, .writes = { resource } });
+        }
+
+        for (auto batch = 0; batch < 3; ++batch) {
+            invoker.Invoke(list);
+        }
+        REQUIRE(std::ranges::all_of(counters, [](int counter) { return counter == 3; }));
+        REQUIRE(shared == 3 * 55);
+        // 顺序不对时前缀和也会不同
+        REQUIRE(history.size() == 30);
+        for (auto i = 0; i < 10; ++i) {
+            REQUIRE(history[i] == (i + 1) * (i + 2) / 2);
+        }
+
+        auto const statistics = invoker.GetStatistics();
+        REQUIRE(statistics.batches == 3);
+        REQUIRE(statistics.commands == 3 * 74);
+        REQUIRE(statistics.min <= statistics.Average());
+        REQUIRE(statistics.Average() <= statistics.max);
+    }
+
+    SECTION("parallel invoker readers") {
+        class Call : public command::Command<AbsCommand> {
+        public:
+            explicit Call(std::function<void()> function) : function_(std::move(function)) {}
+            void Execute() override { function_(); }
+
+        private:
+            std::function<void()> function_;
+        };
+
+        class CallList : public command::CommandList<AbsCommand> {
+        public:
+            CallList() = default;
+        };
+
+        auto pool    = ThreadPool{ 4 };
+        auto invoker = command::ParallelInvoker<AbsCommand>{ pool };
+
+        // 写、8个读、写：读要等第一个写，第二个写要等所有读
+        auto value          = std::atomic<int>{ 0 };
+        auto finished       = std::atomic<int>{ 0 };
+        auto seen           = std::vector<int>(8);
+        auto finished_first = -1;
+        auto const resource = command::ResourceOf(value);
+        auto const write    = command::Access{ .reads = {}, .writes = { resource } };
+        auto const read     = command::Access{ .reads = { resource }, .writes = {} };
+
+        auto list = CallList{};
+        list.Add(
+            Call{ [&value]() {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                value = 1;
+            } },
+            write
+        );
+        for (auto& slot : seen) {
+            list.Add(
+                Call{ [&value, &finished, &slot]() {
+                    slot = value;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    ++finished;
+                } },
+                read
+            );
+        }
+        list.Add(
+            Call{ [&value, &finished, &finished_first]() {
+                finished_first = finished;
+                value          = 2;
+            } },
+            write
+        );
+
+        invoker.Invoke(list);
+        REQUIRE(std::ranges::all_of(seen, [](int slot) { return slot == 1; }));
+        REQUIRE(finished_first == 8);
+        REQUIRE(value == 2);
+
+        // 链中间的命令抛出异常：之后的命令被取消，不相关的命令照常执行
+        auto ran       = std::vector<int>(4);
+        auto chain     = CallList{};
+        auto const mid = command::Access{ .reads = { resource }, .writes = { resource } };
+        chain.Add(Call{ [&ran]() { ran[0] = 1; } }, write);
+        chain.Add(Call{ []() { throw std::runtime_error("failed"); } }, mid);
+        chain.Add(Call{ [&ran]() { ran[1] = 1; } }, read);
+        chain.Add(Call{ [&ran]() { ran[2] = 1; } }, write);
+        chain.Add(Call{ [&ran]() { ran[3] = 1; } });
+
+        REQUIRE_THROWS_AS(invoker.Invoke(chain), std::runtime_error);
+        REQUIRE(ran == std::vector<int>{ 1, 0, 0, 1 });
+        REQUIRE(invoker.GetStatistics().skipped == 2);
+
+        // 取消状态不会带到下一批
+        invoker.Invoke(list);
+        REQUIRE(value == 2);
+        REQUIRE(invoker.GetStatistics().skipped == 2);
+
+        // 复制时抛出异常的命令不会留下多余的资源标注，后面的命令仍然对应自己的标注
+        class Fragile : public command::Command<AbsCommand> {
+        public:
+            Fragile() = default;
+            Fragile(Fragile const&) { throw std::runtime_error("copy failed"); }
+            Fragile(Fragile&&) noexcept = default;
+        };
+
+        auto fragile = Fragile{};
+        auto ordered = CallList{};
+        auto read_as = -1;
+        REQUIRE_THROWS_AS(ordered.Add(fragile, command::Access{}), std::runtime_error);
+        value = 0;
+        ordered.Add(
+            Call{ [&value]() {
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                value = 1;
+            } },
+            write
+        );
+        ordered.Add(Call{ [&value, &read_as]() { read_as = value; } }, read);
+        invoker.Invoke(ordered);
+        REQUIRE(read_as == 1);
+    }
 }
 } // namespace
 
@@ -513,12 +2052,85 @@ protected:
     state::Context<Thread> context_;
 };
 
+// 连接的状态机，事件中带着日志，用来检查进入和退出的顺序
+struct Connect {
+    std::string* log;
+};
+
+struct Established {
+    std::string* log;
+    int port;
+};
+
+struct Close {
+    std::string* log;
+};
+
+struct Disconnected {};
+
+struct Connecting {
+    void OnEntry(Connect const& event) { *event.log += "connecting;"; }
+};
+
+struct Connected {
+    explicit Connected(Established const& event) noexcept : port(event.port) {}
+
+    void OnEntry(Established const& event) { *event.log += "connected;"; }
+    void OnExit(Close const& event) { *event.log += "closed;"; }
+
+    int port;
+};
+
+using Connection = state::StateMachine<
+    meta::TypeList<Disconnected, Connecting, Connected>,
+    meta::TypeList<
+        state::Transition<Disconnected, Connect, Connecting>,
+        state::Transition<Connecting, Established, Connected>,
+        state::Transition<Connecting, Close, Disconnected>,
+        state::Transition<Connected, Close, Disconnected>>>;
+
+static_assert(Connection::kTargets<Connect>[Connection::IndexOf<Connected>] == Connection::kNone);
+
 TEST_CASE("state") {
     SECTION("normal usage") {
         auto tc = ThreadContext{};
         tc.Start();
         tc.Stop();
     }
+
+    SECTION("context") {
+        auto context = state::Context<Thread>{};
+        context.Set(Running{});
+        REQUIRE(context.Castable<Running>());
+        REQUIRE_FALSE(context.Castable<Blocked>());
+    }
+
+    SECTION("state machine") {
+        auto log        = std::string{};
+        auto connection = Connection{};
+        REQUIRE(connection.Is<Disconnected>());
+
+        // 没有对应的转移
+        REQUIRE_FALSE(connection.Dispatch(Close{ &log }));
+        REQUIRE(connection.Is<Disconnected>());
+
+        REQUIRE(connection.Dispatch(Connect{ &log }));
+        REQUIRE(connection.Is<Connecting>());
+        REQUIRE(connection.Dispatch(Established{ &log, 8080 }));
+        REQUIRE(connection.Is<Connected>());
+        REQUIRE(connection.Get<Connected>().port == 8080);
+        REQUIRE(connection.Index() == 2);
+
+        REQUIRE(connection.Dispatch(Close{ &log }));
+        REQUIRE(connection.Is<Disconnected>());
+        REQUIRE(log == "connecting;connected;closed;");
+        REQUIRE_THROWS_AS(connection.Get<Connected>(), std::bad_variant_access);
+
+        auto reconnecting = Connection{ std::in_place_type<Connecting> };
+        REQUIRE(reconnecting.Is<Connecting>());
+        REQUIRE(reconnecting.Dispatch(Close{ &log }));
+        REQUIRE(reconnecting.Is<Disconnected>());
+    }
 }
 } // namespace
 
@@ -576,6 +2188,27 @@ public:
     }
 };
 
+struct Leave {
+    int days;
+    std::string_view approver;
+};
+
+// 只能批准少于Limit天的假期
+template <int Limit>
+struct Approver {
+    bool TryHandle(Leave& leave) {
+        if (leave.days >= Limit) {
+            return false;
+        }
+        leave.approver = name;
+        ++approved;
+        return true;
+    }
+
+    std::string_view name;
+    int approved = 0;
+};
+
 TEST_CASE("handler") {
     SECTION("normal usage") {
         auto teamleader = TeamLeader{};
@@ -589,6 +2222,29 @@ TEST_CASE("handler") {
 
         std::tuple<int, int, int> t;
     }
+
+    SECTION("static chain") {
+        auto chain = StaticChain{ Approver<7>{ "team leader" },
+                                  Approver<15>{ "manager" },
+                                  Approver<30>{ "ceo" } };
+        auto leave = Leave{ 10, {} };
+        REQUIRE(chain.Handle(leave));
+        REQUIRE(leave.approver == "manager");
+        leave = Leave{ 3, {} };
+        REQUIRE(chain.Handle(leave));
+        REQUIRE(leave.approver == "team leader");
+        leave = Leave{ 40, {} };
+        REQUIRE_FALSE(chain.Handle(leave));
+        REQUIRE(leave.approver.empty());
+        REQUIRE(chain.Get<Approver<15>>().approved == 1);
+        REQUIRE(chain.Get<2>().approved == 0);
+
+        // 也可以由类型列表得到
+        auto listed = StaticChainOf<meta::TypeList<Approver<7>, Approver<30>>>{};
+        leave       = Leave{ 10, {} };
+        REQUIRE(listed.Handle(leave));
+        REQUIRE(listed.Get<1>().approved == 1);
+    }
 }
 } // namespace
 